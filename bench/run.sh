@@ -0,0 +1,230 @@
+#!/bin/bash
+# Generates the benchmark workloads and times lispy on each of them.
+# Usage: bench/run.sh [path to lispy binary]
+
+LISPY=${1:-./lispy}
+
+# Arithmetic heavy: many small nested operations
+workload_arith() {
+  for i in $(seq 1 20000); do
+    echo "+ 1 (* 2 3) (- 10 4) (/ 100 5) (* $i (+ $i 1))"
+  done
+}
+
+# Large lists: build, join and take apart a 10000 element Q-Expression
+workload_list() {
+  echo "def {l} {$(seq -s ' ' 1 10000)}"
+  for i in $(seq 1 50); do
+    echo "head (join l l {$i})"
+    echo "eval (head (tail (tail l)))"
+    echo "eval (join {+} l)"
+    echo "head (eval (join {list} l))"
+  done
+}
+
+# Variable reads: look up a large list bound in the environment
+workload_vars() {
+  echo "def {l} {$(seq -s ' ' 1 20000)}"
+  echo "def {first} (\\ {x} {head x})"
+  for i in $(seq 1 100); do
+    echo "first l"
+    echo "head l"
+  done
+}
+
+# Walk a large list: rebind it to its tail, keeping the original alive
+workload_walk() {
+  echo "def {l} {$(seq -s ' ' 1 20000)}"
+  echo "def {w} l"
+  for i in $(seq 1 5000); do
+    echo "def {w} (tail w)"
+  done
+  echo "head w"
+  echo "head l"
+}
+
+# Lambda calls: small functions calling each other
+workload_calls() {
+  echo "def {sq} (\\ {x} {* x x})"
+  echo "def {sumsq} (\\ {x y} {+ (sq x) (sq y)})"
+  echo "def {pair} (\\ {x y} {list (sumsq x y) (sumsq y x) {x y}})"
+  for i in $(seq 1 5000); do
+    echo "pair $i (sumsq $i (sq 3))"
+  done
+}
+
+# Deep call chains: d500 calls d499 and so on down to d0
+workload_deep() {
+  echo "def {d0} (\\ {x} {+ x 1})"
+  for i in $(seq 1 500); do
+    echo "def {d$i} (\\ {x} {d$((i - 1)) (+ x 1)})"
+  done
+  for i in $(seq 1 2000); do
+    echo "d500 $i"
+  done
+}
+
+# List functions calling each other: one call of m10 runs 1024 of m0
+workload_listfn() {
+  echo "def {second} (\\ {l} {head (tail l)})"
+  echo "def {rotate} (\\ {l} {join (tail l) (head l)})"
+  echo "def {m0} (\\ {l} {rotate (join (second l) (tail l))})"
+  for i in $(seq 1 10); do
+    p="m$((i - 1))"
+    echo "def {m$i} (\\ {l} {$p ($p l)})"
+  done
+  for i in $(seq 1 100); do
+    echo "head (m10 {$i 2 3 4 5 6 7 8})"
+  done
+}
+
+# Higher-order code: lambdas passed down through several layers of calls
+workload_higher() {
+  echo "def {apply} (\\ {f x} {f x})"
+  echo "def {twice} (\\ {f x} {apply f (apply f x)})"
+  echo "def {thrice} (\\ {f x} {twice f (apply f x)})"
+  echo "def {inc} (\\ {x} {+ x 1})"
+  for i in $(seq 1 3000); do
+    echo "thrice inc (twice (\\ {y} {* y 2}) $i)"
+  done
+}
+
+# Evaluation bound: each level calls the one below four times, so that a
+# single call of l8 runs 65536 additions
+workload_nest() {
+  echo "def {l0} (\\ {x} {+ x 1})"
+  for i in $(seq 1 8); do
+    p="l$((i - 1))"
+    echo "def {l$i} (\\ {x} {$p ($p ($p ($p x)))})"
+  done
+  for i in $(seq 1 10); do
+    echo "l8 $i"
+  done
+}
+
+# Tail recursion: a counting loop of a million iterations
+workload_loop() {
+  echo "def {count} (\\ {n acc} {if (== n 0) {acc} {count (- n 1) (+ acc 1)}})"
+  echo "count 1000000 0"
+}
+
+# Non-tail recursion: each call makes two more, so fib 27 runs about 630000
+# calls whose arguments and results die right away
+workload_fib() {
+  echo "def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})"
+  echo "fib 27"
+}
+
+# Arithmetic throughput: a loop making four two-argument operations per
+# iteration, the same with three arguments each, and top-level operations
+workload_ops2() {
+  echo "def {ops} (\\ {n acc} {if (== n 0) {acc} {ops (- n 1) (- (+ acc (* n 3)) (/ n 2))}})"
+  echo "ops 500000 0"
+}
+
+workload_ops3() {
+  echo "def {ops} (\\ {n acc} {if (== n 0) {acc} {ops (- n 1 0) (- (+ acc (* n 3 1) 0) (/ n 2 1) 0)}})"
+  echo "ops 500000 0"
+}
+
+workload_opstop() {
+  for i in $(seq 1 20000); do
+    echo "- (+ $i (* $i 3)) (/ $i 2)"
+  done
+}
+
+# Constant subexpressions in a lambda body
+workload_fold() {
+  echo "def {secs} (\\ {d} {+ (* d 60 60 24) (* 60 (+ 1 (* 7 5) 3)) (- (/ 3600 60) 1)})"
+  echo "def {run} (\\ {n acc} {if (== n 0) {acc} {run (- n 1) (+ acc (secs n))}})"
+  echo "run 200000 0"
+}
+
+# Pipelines of partial applications of a lambda with a large body: building
+# one should only cost the arguments it binds
+workload_partial() {
+  echo "def {step} (\\ {a b x} {if (> x 0) {+ a b x} {+ $(seq -s ' ' 1 1000)}})"
+  echo "def {apply} (\\ {f x} {f x})"
+  echo "def {run} (\\ {n acc} {if (== n 0) {acc} {run (- n 1) (+ acc ((step 1) 2 n) (apply (step n 1) 1))}})"
+  echo "run 200000 0"
+}
+
+# An expensive function called over and over with list arguments: half of
+# the calls with a few of them, the others with more than the cache keeps
+workload_memo() {
+  echo "def {sum} (\\ {l acc} {if (== l {}) {acc} {sum (tail l) (+ acc (eval (head l)))}})"
+  echo "def {work} (\\ {l n} {if (== n 0) {0} {+ (sum l 0) (work l (- n 1))}})"
+  echo "def {mwork} (memo work 48)"
+  for i in $(seq 1 1000); do
+    echo "mwork {$(seq -s ' ' 1 $((i % 2 ? i % 8 + 100 : i % 97 + 100)))} 10"
+  done
+}
+
+# A lambda with a large generated body, of which each call only runs a
+# small part: calls should cost the same whatever the size of the body
+workload_body() {
+  local n=$1
+  echo "def {big} (\\ {x} {if (> x 0) {+ x 1} {+ $(seq -s ' ' 1 "$n")}})"
+  echo "def {quote} (\\ {x} {eval {if (> x 0) {x} {+ $(seq -s ' ' 1 "$n")}}})"
+  echo "def {run} (\\ {n acc} {if (== n 0) {acc} {run (- n 1) (+ acc (big n) (quote n))}})"
+  echo "run 100000 0"
+}
+
+# Many distinct symbols, looked up from deep scopes
+workload_syms() {
+  for i in $(seq 1 2000); do
+    echo "def {variable_number_$i} $i"
+  done
+  echo "def {s0} (\\ {a0} {+ a0 variable_number_1 variable_number_2000})"
+  for i in $(seq 1 20); do
+    echo "def {s$i} (\\ {a$i} {s$((i - 1)) (+ a$i variable_number_$((i * 50)))})"
+  done
+  for i in $(seq 1 2000); do
+    echo "s20 variable_number_$i"
+  done
+}
+
+# Global lookups with $1 globals defined: one call of g8 looks up three of
+# them 65536 times, and the g functions themselves
+workload_bindings() {
+  local n=$1
+  for s in $(seq 1 1000 "$n"); do
+    e=$((s + 999 < n ? s + 999 : n))
+    echo "def {$(seq -f 'b%g' -s ' ' "$s" "$e")} $(seq -s ' ' "$s" "$e")"
+  done
+  echo "def {g0} (\\ {x} {+ x b1 b$((n / 2)) b$n})"
+  for i in $(seq 1 8); do
+    p="g$((i - 1))"
+    echo "def {g$i} (\\ {x} {$p ($p ($p ($p x)))})"
+  done
+  for i in $(seq 1 5); do
+    echo "g8 $i"
+  done
+}
+
+run() {
+  local name=$1
+  shift
+  local input
+  input=$(mktemp)
+  {
+    workload_$name "$@"
+    echo printstats
+    echo q
+  } >"$input"
+  echo "== $name $*"
+  TIMEFORMAT="time: %3R s"
+  time ("$LISPY" <"$input" | sed -n '/^lval allocations/,$p')
+  rm -f "$input"
+}
+
+for w in ${WORKLOADS:-arith list vars walk calls listfn higher deep nest syms loop fib fold ops2 ops3 opstop partial memo}; do
+  run "$w"
+done
+for n in ${BODY-10 10000}; do
+  run body "$n"
+done
+# Lookup time should not depend on the number of bindings
+for n in ${BINDINGS-10 1000 100000}; do
+  run bindings "$n"
+done
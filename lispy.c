@@ -1,5 +1,8 @@
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "mpc.h"
 #include <editline/readline.h>
@@ -15,53 +18,970 @@
 
 struct lval;
 struct lenv;
+struct lbuf;
+struct lcode;
+struct lfold;
+struct cnode;
+struct lmemo;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lbuf lbuf;
+typedef struct lcode lcode;
+typedef struct lfold lfold;
+typedef struct cnode cnode;
+typedef struct lmemo lmemo;
 
 /* Create Enumeration of Possible lval Types */
 enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN };
 
+/* Where a symbol was last found: nowhere yet, in the frame it was evaluated
+ * in, or in the global environment */
+enum { SYM_UNRESOLVED, SYM_LOCAL, SYM_GLOBAL };
+
+/* Instructions of compiled lambda bodies, see `lcode` */
+enum {
+  OP_CONST,
+  OP_LOOKUP,
+  OP_LOCAL,
+  OP_EMPTY,
+  OP_CALL,
+  OP_TAILCALL,
+  OP_FOLD,
+  OP_RETURN
+};
+
+/* Type tags of the heap objects which are not lvals */
+enum { OBJ_ENV = 100, OBJ_FREE, OBJ_FORWARD };
+
 typedef lval *(*lbuiltin)(lenv *, lval *);
 
-/* Declare New lval Struct */
+lval *builtin_memoized(lenv *e, lval *a);
+
+/* Declare New lval Struct
+ *
+ * Only the fields of the active type are stored: they share the same memory
+ * behind the type tag, which keeps every lval at 40 bytes on 64 bit targets. */
 typedef struct lval {
-  int type;
+  unsigned char type;
+  /* Collector flags, see `gc_collect` and `gc_write_barrier` */
+  unsigned char mark;
+  /* Number of references to this value, see `lval_ref` */
+  int rc;
+
+  union {
+    /* Basic */
+    long num;
+    char *err;
+
+    /* Symbol
+     *
+     * Interned, see `sym_intern`. scope, slot and version remember where
+     * the symbol was found when last evaluated, see `lenv_get`. */
+    struct {
+      char *sym;
+      int scope;
+      int slot;
+      long version;
+    };
+
+    /* Function
+     *
+     * builtin is NULL for lambdas. Memoized functions have
+     * `builtin_memoized` as builtin, and their cache in memo. */
+    struct {
+      lbuiltin builtin;
+      union {
+        lenv *env;
+        lmemo *memo;
+      };
+      lval *formals;
+      lval *body;
+    };
+
+    /* Expression
+     *
+     * The children are cell[0] to cell[count - 1]. cell points inside buf,
+     * which may be shared with other lists, see `lbuf`. code is set on
+     * lambda bodies once they are compiled, see `lval_code`. */
+    struct {
+      int count;
+      lval **cell;
+      lbuf *buf;
+      lcode *code;
+    };
+
+    /* Where a promoted nursery value went, see `gc_minor` */
+    lval *forward;
+  };
+} lval;
 
-  /* Basic */
-  long num;
-  char *err;
-  char *sym;
+/* Storage of the children of lists
+ *
+ * A buffer holds one reference to each of items[start] to items[used - 1],
+ * and is itself reference counted. Lists are views of a slice of a buffer,
+ * so several lists can share one buffer: `tail` just views one item less,
+ * and copying a list only takes a new reference to its buffer. A buffer is
+ * only written to while a single list uses it, see `lval_own_cells`. */
+struct lbuf {
+  int rc;
+  int start;
+  int used;
+  int capacity;
+  /* Set when an item may be in the nursery, see `gc_write_barrier` */
+  int young;
+  lval *items[];
+};
 
-  /* Function */
-  lbuiltin builtin;
-  lenv *env;
-  lval *formals;
-  lval *body;
+/* Compiled lambda body
+ *
+ * ops holds pairs of an opcode and its argument, run by `vm_run`. The
+ * values the code pushes, and the symbols it looks up, are in consts,
+ * which holds a reference to each. */
+struct lcode {
+  int count;
+  int capacity;
+  int *ops;
+  int const_count;
+  lval **consts;
+  /* Formals of the lambda the code was compiled for, OP_LOCAL i reads the
+   * value bound to formals[i] */
+  int formal_count;
+  char **formals;
+  /* Closures the body was compiled to instead of ops, see `cnode` */
+  cnode *tree;
+  /* Subexpressions computed at compile time, see `lcode_fold` */
+  int fold_count;
+  lfold *folds;
+};
+
+/* A folded subexpression: consts[value] is its value, as long as each
+ * consts[guards[i]] symbol is bound to builtins[i]. Otherwise consts[expr],
+ * the subexpression itself, is evaluated. */
+struct lfold {
+  int value;
+  int expr;
+  int guard_count;
+  int *guards;
+  lbuiltin *builtins;
+};
 
-  /* Expression */
+/* Cached result of a memoized function */
+typedef struct lmemo_entry {
+  unsigned long hash;
+  lval *args;
+  lval *value;
+  /* Neighbours in least recently used order, or -1 */
+  int prev;
+  int next;
+} lmemo_entry;
+
+/* Results of a memoized function, see `builtin_memo`
+ *
+ * Argument lists are looked up by their structural hash in index, an open
+ * addressing table of positions in entries plus one, and compared with
+ * `lval_eq`. Entries are chained from the most to the least recently used:
+ * once size entries are kept, a new result replaces the least recently
+ * used one. The cache only holds tenured values, so the nursery collector
+ * can ignore it. */
+struct lmemo {
+  /* Copies of a memoized function share its cache */
+  int rc;
+  lval *fn;
   int count;
-  lval **cell;
-} lval;
+  int size;
+  /* Size of entries, grown up to size */
+  int capacity;
+  lmemo_entry *entries;
+  /* Size of index, a power of two at least twice capacity */
+  int index_capacity;
+  int *index;
+  int newest;
+  int oldest;
+  long hits;
+  long misses;
+  long evictions;
+};
 
 struct lenv {
-  lenv *par;
+  /* Always OBJ_ENV, lets the collector tell lenvs and lvals apart */
+  unsigned char type;
+  unsigned char mark;
+  /* Functions share their environment, see `lval_copy` */
+  int rc;
   int count;
+  /* Size of syms and vals */
+  int capacity;
+  /* Size of index, a power of two, or 0 while the frame is small */
+  int index_capacity;
+  lenv *par;
+  /* Interned, see `sym_intern` */
   char **syms;
   lval **vals;
+  /* Open addressing table of positions in syms plus one, 0 being empty,
+   * see `lenv_find` */
+  int *index;
 };
 
+/* Small integers are not allocated: they live in the lval pointer itself,
+ * shifted left by one with the lowest bit set. Heap lvals are always at least
+ * word aligned, so that bit is never set on a real pointer. Numbers which do
+ * not fit in the remaining bits fall back to a boxed LVAL_NUM. */
+#define FIXNUM_MAX (LONG_MAX >> 1)
+#define FIXNUM_MIN (LONG_MIN >> 1)
+
+int lval_is_fixnum(lval *v) { return ((uintptr_t)v & 1) != 0; }
+
+int lval_type(lval *v) { return lval_is_fixnum(v) ? LVAL_NUM : v->type; }
+
+long lval_num_value(lval *v) {
+  if (lval_is_fixnum(v)) {
+    return (long)((intptr_t)v >> 1);
+  }
+  return v->num;
+}
+
+/* Memory pools
+ *
+ * lvals and lenvs are small, fixed size and allocated at a very high rate, so
+ * rather than going through malloc for each of them they are carved out of
+ * large slabs. Objects are grouped by size class, and each class keeps the
+ * objects freed so far in an intrusive free list.
+ *
+ * Pooled objects start with a type byte, which is OBJ_FREE for the slots on
+ * the free list. This lets the collector walk every slot of every slab and
+ * find the live objects. Sizes above the largest class go straight to malloc
+ * and are not seen by the collector.
+ *
+ * Compile with -DLISPY_NO_POOL to use plain malloc and free instead, which
+ * is handy under valgrind or address sanitizer. The objects of each class are
+ * then chained in a list so that the collector can still find them. */
+#define POOL_GRANULE 8
+#define POOL_CLASSES 16
+#define SLAB_BYTES (64 * 1024)
+
+typedef struct free_slot {
+  unsigned char type;
+  struct free_slot *next;
+} free_slot;
+
+typedef struct slab {
+  struct slab *next;
+  /* With LISPY_NO_POOL, each object gets its own single slot slab */
+  struct slab *prev;
+} slab;
+
+typedef struct pool {
+  free_slot *free_list;
+  slab *slabs;
+  long slab_count;
+  long used;
+  long peak;
+  long capacity;
+} pool;
+
+pool pools[POOL_CLASSES];
+
+/* Bytes of pooled objects in use, which drives the collector */
+long pool_bytes = 0;
+
+int pool_class(size_t size) { return (size + POOL_GRANULE - 1) / POOL_GRANULE - 1; }
+
+size_t pool_class_size(int c) { return (c + 1) * POOL_GRANULE; }
+
+/* First slot of a slab, and number of slots in it */
+char *slab_start(slab *s) { return (char *)s + sizeof(slab); }
+
+long slab_slots(size_t size) {
+#ifdef LISPY_NO_POOL
+  return 1;
+#else
+  return (SLAB_BYTES - sizeof(slab)) / size;
+#endif
+}
+
+void pool_grow(pool *p, size_t size) {
+  slab *s = malloc(SLAB_BYTES);
+  s->next = p->slabs;
+  p->slabs = s;
+  p->slab_count++;
+
+  /* Thread every object of the new slab onto the free list */
+  long n = slab_slots(size);
+  for (long i = n - 1; i >= 0; i--) {
+    free_slot *obj = (free_slot *)(slab_start(s) + i * size);
+    obj->type = OBJ_FREE;
+    obj->next = p->free_list;
+    p->free_list = obj;
+  }
+  p->capacity += n;
+}
+
+void *pool_alloc(size_t size) {
+  int c = pool_class(size);
+  if (c >= POOL_CLASSES) {
+    return malloc(size);
+  }
+  pool *p = &pools[c];
+  if (++p->used > p->peak) {
+    p->peak = p->used;
+  }
+  pool_bytes += pool_class_size(c);
+#ifdef LISPY_NO_POOL
+  slab *s = malloc(sizeof(slab) + size);
+  s->prev = NULL;
+  s->next = p->slabs;
+  if (p->slabs) {
+    p->slabs->prev = s;
+  }
+  p->slabs = s;
+  return slab_start(s);
+#else
+  if (p->free_list == NULL) {
+    pool_grow(p, pool_class_size(c));
+  }
+  free_slot *obj = p->free_list;
+  p->free_list = obj->next;
+  return obj;
+#endif
+}
+
+void pool_free(void *ptr, size_t size) {
+  int c = pool_class(size);
+  if (c >= POOL_CLASSES) {
+    free(ptr);
+    return;
+  }
+  pool *p = &pools[c];
+  p->used--;
+  pool_bytes -= pool_class_size(c);
+#ifdef LISPY_NO_POOL
+  slab *s = (slab *)((char *)ptr - sizeof(slab));
+  if (s->prev) {
+    s->prev->next = s->next;
+  } else {
+    p->slabs = s->next;
+  }
+  if (s->next) {
+    s->next->prev = s->prev;
+  }
+  free(s);
+#else
+  free_slot *obj = ptr;
+  obj->type = OBJ_FREE;
+  obj->next = p->free_list;
+  p->free_list = obj;
+#endif
+}
+
+/* Statistics, printed by the `printstats` command */
+long lval_allocs = 0;
+long vm_calls = 0;
+long tree_calls = 0;
+long lenv_cache_hits = 0;
+long lenv_cache_misses = 0;
+
+/* Garbage collection
+ *
+ * Reference counting frees most values as soon as their last owner drops
+ * them, but whatever is leaked or caught in a cycle is never reclaimed that
+ * way. A mark and sweep collector takes care of these: it marks everything
+ * reachable from the roots, then frees every other pooled object.
+ *
+ * Most values die young, so new lvals are not taken from the pools but bump
+ * allocated in a fixed size nursery. Once it is full, allocation falls back
+ * to the pools until the next safe point, where a minor collection copies
+ * the nursery values still reachable to the pools and empties the nursery.
+ * Values in the pools which point into the nursery are found through the
+ * remembered set filled by `gc_write_barrier`, and every lenv is scanned, so
+ * lenvs need no barrier. Since values move, the root stack holds the
+ * address of each root variable rather than its value.
+ *
+ * The roots are the environments and values pushed on the root stack: the
+ * REPL pushes the global environment, and each evaluation frame pushes the
+ * environment and the expression it is working on. The collector only runs
+ * at safe points, from `gc_maybe_collect`, where every live object is
+ * reachable from a root. Build with -DLISPY_GC_STRESS to collect at every
+ * safe point.
+ *
+ * A collection is triggered once the pooled objects exceed `gc_next` bytes.
+ * After each collection the threshold is set to `gc_growth` percent of what
+ * survived, but never below `gc_min_heap`. Both can be tuned with the
+ * LISPY_GC_MIN_HEAP and LISPY_GC_GROWTH environment variables, or from the
+ * REPL with the `gc` builtin. */
+#define GC_MIN_HEAP (1024 * 1024)
+#define GC_GROWTH 200
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE 8192
+#endif
+
+/* Bits of the `mark` field */
+#define GC_MARKED 1
+#define GC_REMEMBERED 2
+/* Set on lenvs which only ever hold pooled values, see `lval_tenure` */
+#define GC_TENURED 4
+
+/* Pause histogram buckets, in microseconds */
+#define GC_BUCKETS 5
+long gc_bucket_limits[GC_BUCKETS] = {10, 100, 1000, 10000, LONG_MAX};
+
+/* Common header of every pooled object */
+typedef struct gc_header {
+  unsigned char type;
+  unsigned char mark;
+  int rc;
+} gc_header;
+
+typedef struct gc_root {
+  lval **val;
+  lenv *env;
+} gc_root;
+
+gc_root *gc_roots = NULL;
+int gc_roots_count = 0;
+int gc_roots_capacity = 0;
+
+void **gc_mark_stack = NULL;
+long gc_mark_count = 0;
+long gc_mark_capacity = 0;
+
+long gc_min_heap = GC_MIN_HEAP;
+long gc_growth = GC_GROWTH;
+long gc_next = GC_MIN_HEAP;
+
+lval nursery[NURSERY_SIZE];
+lval *nursery_top = nursery;
+int gc_minor_pending = 0;
+
+lval **gc_remembered = NULL;
+long gc_remembered_count = 0;
+long gc_remembered_capacity = 0;
+
+/* Recycled lambda call frames, by capacity, linked through par, see
+ * `lenv_frame` */
+#define FRAME_CLASSES 4
+lenv *frame_pool[FRAME_CLASSES];
+
+void cnode_free(cnode *n);
+
+/* Release the memory of code whose constants were already released */
+void lcode_free(lcode *c) {
+  cnode_free(c->tree);
+  for (int i = 0; i < c->fold_count; i++) {
+    free(c->folds[i].guards);
+    free(c->folds[i].builtins);
+  }
+  free(c->folds);
+  free(c->ops);
+  free(c->consts);
+  free(c->formals);
+  free(c);
+}
+
+/* Values being worked on by the VM, which are roots, see `vm_run` */
+lval **vm_stack = NULL;
+int vm_sp = 0;
+int vm_capacity = 0;
+
+/* Values promoted by the current minor collection, not scanned yet */
+lval **gc_promoted = NULL;
+long gc_promoted_count = 0;
+long gc_promoted_capacity = 0;
+
+/* Statistics, printed by the `printstats` command */
+long gc_collections = 0;
+long gc_collected_total = 0;
+double gc_pause_total = 0;
+double gc_pause_max = 0;
+long gc_minor_collections = 0;
+long gc_promoted_total = 0;
+long gc_form_releases = 0;
+long gc_minor_pauses[GC_BUCKETS];
+long gc_major_pauses[GC_BUCKETS];
+
+/* With address sanitizer, the free part of the nursery is poisoned so that
+ * values used after being moved are reported */
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define NURSERY_POISON(p, n) ASAN_POISON_MEMORY_REGION(p, n)
+#define NURSERY_UNPOISON(p, n) ASAN_UNPOISON_MEMORY_REGION(p, n)
+#else
+#define NURSERY_POISON(p, n)
+#define NURSERY_UNPOISON(p, n)
+#endif
+
+int lval_is_young(lval *v) {
+  return !lval_is_fixnum(v) && v >= nursery && v < nursery + NURSERY_SIZE;
+}
+
+void gc_record_pause(long *histogram, double pause) {
+  long us = pause * 1e6;
+  int b = 0;
+  while (us >= gc_bucket_limits[b]) {
+    b++;
+  }
+  histogram[b]++;
+}
+
+/* Must be called whenever `child` is stored in `parent`: pooled values
+ * which point into the nursery are remembered, to be scanned by the next
+ * minor collection */
+void gc_write_barrier(lval *parent, lval *child) {
+  if (!lval_is_young(child)) {
+    return;
+  }
+  if ((parent->type == LVAL_SEXPR || parent->type == LVAL_QEXPR) &&
+      parent->buf) {
+    parent->buf->young = 1;
+  }
+  if (lval_is_young(parent) || (parent->mark & GC_REMEMBERED)) {
+    return;
+  }
+  parent->mark |= GC_REMEMBERED;
+  if (gc_remembered_count == gc_remembered_capacity) {
+    gc_remembered_capacity =
+        gc_remembered_capacity ? gc_remembered_capacity * 2 : 64;
+    gc_remembered =
+        realloc(gc_remembered, sizeof(lval *) * gc_remembered_capacity);
+  }
+  gc_remembered[gc_remembered_count++] = parent;
+}
+
+/* Same, for a value whose children were all just set */
+void gc_write_barrier_all(lval *parent) {
+  if (lval_is_young(parent)) {
+    return;
+  }
+  switch (parent->type) {
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    /* The whole buffer, not only the slice the list sees */
+    if (parent->buf) {
+      for (int i = parent->buf->start; i < parent->buf->used; i++) {
+        gc_write_barrier(parent, parent->buf->items[i]);
+      }
+    }
+    if (parent->code) {
+      for (int i = 0; i < parent->code->const_count; i++) {
+        gc_write_barrier(parent, parent->code->consts[i]);
+      }
+    }
+    break;
+  case LVAL_FUN:
+    if (parent->builtin == NULL) {
+      gc_write_barrier(parent, parent->formals);
+      gc_write_barrier(parent, parent->body);
+    }
+    break;
+  }
+}
+
+void gc_push_root(lval **val, lenv *env) {
+  if (gc_roots_count == gc_roots_capacity) {
+    gc_roots_capacity = gc_roots_capacity ? gc_roots_capacity * 2 : 64;
+    gc_roots = realloc(gc_roots, sizeof(gc_root) * gc_roots_capacity);
+  }
+  gc_roots[gc_roots_count].val = val;
+  gc_roots[gc_roots_count].env = env;
+  gc_roots_count++;
+}
+
+/* Register the variable at `slot`, the collector reads it when it runs */
+void gc_push_val(lval **slot) { gc_push_root(slot, NULL); }
+
+void gc_push_env(lenv *e) { gc_push_root(NULL, e); }
+
+/* Roots are pushed and popped in stack order: save the height of the root
+ * stack on entry, and restore it before returning */
+int gc_roots_save(void) { return gc_roots_count; }
+
+void gc_roots_restore(int height) { gc_roots_count = height; }
+
+void gc_mark(void *obj) {
+  if (obj == NULL || lval_is_fixnum(obj) ||
+      (((gc_header *)obj)->mark & GC_MARKED)) {
+    return;
+  }
+  ((gc_header *)obj)->mark |= GC_MARKED;
+  if (gc_mark_count == gc_mark_capacity) {
+    gc_mark_capacity = gc_mark_capacity ? gc_mark_capacity * 2 : 256;
+    gc_mark_stack = realloc(gc_mark_stack, sizeof(void *) * gc_mark_capacity);
+  }
+  gc_mark_stack[gc_mark_count++] = obj;
+}
+
+void gc_mark_children(void *obj) {
+  if (((gc_header *)obj)->type == OBJ_ENV) {
+    lenv *e = obj;
+    gc_mark(e->par);
+    for (int i = 0; i < e->count; i++) {
+      gc_mark(e->vals[i]);
+    }
+    return;
+  }
+  lval *v = obj;
+  switch (v->type) {
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (v->buf) {
+      for (int i = v->buf->start; i < v->buf->used; i++) {
+        gc_mark(v->buf->items[i]);
+      }
+    }
+    if (v->code) {
+      for (int i = 0; i < v->code->const_count; i++) {
+        gc_mark(v->code->consts[i]);
+      }
+    }
+    break;
+  case LVAL_FUN:
+    if (v->builtin == NULL) {
+      gc_mark(v->env);
+      gc_mark(v->formals);
+      gc_mark(v->body);
+    } else if (v->builtin == builtin_memoized) {
+      gc_mark(v->memo->fn);
+      for (int i = 0; i < v->memo->count; i++) {
+        gc_mark(v->memo->entries[i].args);
+        gc_mark(v->memo->entries[i].value);
+      }
+    }
+    break;
+  }
+}
+
+/* A garbage object is going away: the reachable values it points to lose a
+ * reference, the unreachable ones are being swept anyway */
+void gc_drop(void *obj) {
+  if (obj != NULL && !lval_is_fixnum(obj) &&
+      (((gc_header *)obj)->mark & GC_MARKED)) {
+    ((gc_header *)obj)->rc--;
+  }
+}
+
+/* Release what a garbage object owns, but not the object itself, so that
+ * the objects still to be finalized can look at its mark. Returns the
+ * number of bytes released. */
+long gc_finalize(void *obj) {
+  long bytes = 0;
+  if (((gc_header *)obj)->type == OBJ_ENV) {
+    lenv *e = obj;
+    for (int i = 0; i < e->count; i++) {
+      gc_drop(e->vals[i]);
+    }
+    bytes += (sizeof(char *) + sizeof(lval *)) * e->count;
+    free(e->syms);
+    free(e->vals);
+    free(e->index);
+    bytes += sizeof(int) * e->index_capacity;
+    return bytes;
+  }
+  lval *v = obj;
+  switch (v->type) {
+  case LVAL_ERR:
+    bytes += strlen(v->err) + 1;
+    free(v->err);
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (v->buf && --v->buf->rc == 0) {
+      for (int i = v->buf->start; i < v->buf->used; i++) {
+        gc_drop(v->buf->items[i]);
+      }
+      bytes += sizeof(lbuf) + sizeof(lval *) * v->buf->capacity;
+      free(v->buf);
+    }
+    if (v->code) {
+      for (int i = 0; i < v->code->const_count; i++) {
+        gc_drop(v->code->consts[i]);
+      }
+      lcode_free(v->code);
+    }
+    break;
+  case LVAL_FUN:
+    if (v->builtin == NULL) {
+      gc_drop(v->env);
+      gc_drop(v->formals);
+      gc_drop(v->body);
+    } else if (v->builtin == builtin_memoized && --v->memo->rc == 0) {
+      lmemo *m = v->memo;
+      gc_drop(m->fn);
+      for (int i = 0; i < m->count; i++) {
+        gc_drop(m->entries[i].args);
+        gc_drop(m->entries[i].value);
+      }
+      bytes += sizeof(lmemo) + sizeof(lmemo_entry) * m->capacity +
+               sizeof(int) * m->index_capacity;
+      free(m->entries);
+      free(m->index);
+      free(m);
+    }
+    break;
+  }
+  return bytes;
+}
+
+/* Visit the objects of every pool class, finalizing or freeing the garbage
+ * and clearing the marks of the survivors */
+long gc_sweep(int release) {
+  long bytes = 0;
+  for (int c = 0; c < POOL_CLASSES; c++) {
+    size_t size = pool_class_size(c);
+    long n = slab_slots(size);
+    slab *s = pools[c].slabs;
+    while (s) {
+      /* With LISPY_NO_POOL, freeing the object frees its slab */
+      slab *next = s->next;
+      for (long i = 0; i < n; i++) {
+        gc_header *obj = (gc_header *)(slab_start(s) + i * size);
+        if (obj->type == OBJ_FREE) {
+          continue;
+        }
+        if (!release) {
+          if (!(obj->mark & GC_MARKED)) {
+            bytes += gc_finalize(obj);
+          }
+        } else if (obj->mark & GC_MARKED) {
+          obj->mark &= ~GC_MARKED;
+        } else {
+          pool_free(obj, size);
+          bytes += size;
+        }
+      }
+      s = next;
+    }
+  }
+  return bytes;
+}
+
+lval *gc_promote(lval *v) {
+  if (v == NULL || !lval_is_young(v)) {
+    return v;
+  }
+  if (v->type == OBJ_FORWARD) {
+    return v->forward;
+  }
+  lval *x = pool_alloc(sizeof(lval));
+  *x = *v;
+  v->type = OBJ_FORWARD;
+  v->forward = x;
+  if (gc_promoted_count == gc_promoted_capacity) {
+    gc_promoted_capacity = gc_promoted_capacity ? gc_promoted_capacity * 2 : 64;
+    gc_promoted = realloc(gc_promoted, sizeof(lval *) * gc_promoted_capacity);
+  }
+  gc_promoted[gc_promoted_count++] = x;
+  return x;
+}
+
+void gc_promote_children(lval *v) {
+  switch (v->type) {
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    if (v->buf) {
+      for (int i = v->buf->start; i < v->buf->used; i++) {
+        v->buf->items[i] = gc_promote(v->buf->items[i]);
+      }
+      v->buf->young = 0;
+    }
+    if (v->code) {
+      for (int i = 0; i < v->code->const_count; i++) {
+        v->code->consts[i] = gc_promote(v->code->consts[i]);
+      }
+    }
+    break;
+  case LVAL_FUN:
+    if (v->builtin == NULL) {
+      v->formals = gc_promote(v->formals);
+      v->body = gc_promote(v->body);
+    }
+    break;
+  }
+}
+
+/* Move the reachable nursery values to the pools and empty the nursery */
+void gc_evacuate(void) {
+  for (int i = 0; i < gc_roots_count; i++) {
+    if (gc_roots[i].val) {
+      *gc_roots[i].val = gc_promote(*gc_roots[i].val);
+    }
+  }
+  for (int i = 0; i < vm_sp; i++) {
+    vm_stack[i] = gc_promote(vm_stack[i]);
+  }
+  /* Every lenv may point into the nursery */
+  int c = pool_class(sizeof(lenv));
+  long n = slab_slots(pool_class_size(c));
+  for (slab *s = pools[c].slabs; s; s = s->next) {
+    for (long i = 0; i < n; i++) {
+      lenv *e = (lenv *)(slab_start(s) + i * pool_class_size(c));
+      if (e->type != OBJ_ENV || (e->mark & GC_TENURED)) {
+        continue;
+      }
+      for (int j = 0; j < e->count; j++) {
+        e->vals[j] = gc_promote(e->vals[j]);
+      }
+    }
+  }
+  for (long i = 0; i < gc_remembered_count; i++) {
+    gc_remembered[i]->mark &= ~GC_REMEMBERED;
+    gc_promote_children(gc_remembered[i]);
+  }
+  gc_remembered_count = 0;
+  while (gc_promoted_count > 0) {
+    gc_promote_children(gc_promoted[--gc_promoted_count]);
+    gc_promoted_total++;
+  }
+
+  /* What was neither promoted nor freed is unreachable */
+  for (lval *v = nursery; v < nursery_top; v++) {
+    if (v->type != OBJ_FORWARD && v->type != OBJ_FREE) {
+      gc_finalize(v);
+    }
+  }
+  NURSERY_POISON(nursery, (char *)nursery_top - (char *)nursery);
+  nursery_top = nursery;
+  gc_minor_pending = 0;
+}
+
+void gc_minor(void) {
+  clock_t start = clock();
+  gc_evacuate();
+  gc_minor_collections++;
+  gc_record_pause(gc_minor_pauses, (double)(clock() - start) / CLOCKS_PER_SEC);
+}
+
+/* A top-level form has been evaluated, so the nursery now mostly holds its
+ * temporaries: release them all at once. What escaped into the global
+ * environment was already copied out, so the work done is proportional to
+ * what the form allocated and not to the size of the heap. */
+void gc_end_form(void) {
+  if (nursery_top == nursery) {
+    return;
+  }
+  gc_evacuate();
+  gc_form_releases++;
+}
+
+/* Run a full collection, returning the number of bytes reclaimed */
+long gc_collect(void) {
+  /* Empty the nursery first, so that only the pools need sweeping */
+  gc_minor();
+
+  clock_t start = clock();
+
+  for (int i = 0; i < gc_roots_count; i++) {
+    gc_mark(gc_roots[i].env);
+    if (gc_roots[i].val) {
+      gc_mark(*gc_roots[i].val);
+    }
+  }
+  for (int c = 0; c < FRAME_CLASSES; c++) {
+    gc_mark(frame_pool[c]);
+  }
+  for (int i = 0; i < vm_sp; i++) {
+    gc_mark(vm_stack[i]);
+  }
+  while (gc_mark_count > 0) {
+    gc_mark_children(gc_mark_stack[--gc_mark_count]);
+  }
+  long bytes = gc_sweep(0);
+  bytes += gc_sweep(1);
+
+  gc_next = pool_bytes * gc_growth / 100;
+  if (gc_next < gc_min_heap) {
+    gc_next = gc_min_heap;
+  }
+
+  double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+  gc_collections++;
+  gc_collected_total += bytes;
+  gc_pause_total += pause;
+  if (pause > gc_pause_max) {
+    gc_pause_max = pause;
+  }
+  gc_record_pause(gc_major_pauses, pause);
+  return bytes;
+}
+
+/* Safe point: empty the nursery if it overflowed, and collect if the heap
+ * has grown past the threshold */
+void gc_maybe_collect(void) {
+#ifdef LISPY_GC_STRESS
+  gc_collect();
+#else
+  if (pool_bytes >= gc_next) {
+    gc_collect();
+  } else if (gc_minor_pending) {
+    gc_minor();
+  }
+#endif
+}
+
+/* min_heap must be positive and growth above 100 */
+void gc_configure(long min_heap, long growth) {
+  gc_min_heap = min_heap;
+  gc_growth = growth;
+  gc_next = gc_min_heap;
+}
+
+/* Must run before the first allocation */
+void gc_init(void) {
+  /* Invalid settings from the environment leave the defaults in place */
+  char *env = getenv("LISPY_GC_MIN_HEAP");
+  long min_heap = env ? atol(env) : 0;
+  env = getenv("LISPY_GC_GROWTH");
+  long growth = env ? atol(env) : 0;
+  gc_configure(min_heap > 0 ? min_heap : GC_MIN_HEAP,
+               growth > 100 ? growth : GC_GROWTH);
+  NURSERY_POISON(nursery, sizeof(nursery));
+}
+
+/* Allocation is a pointer increment while the nursery has room */
+lval *lval_alloc(void) {
+  lval_allocs++;
+  lval *v;
+  if (nursery_top < nursery + NURSERY_SIZE) {
+    v = nursery_top++;
+    NURSERY_UNPOISON(v, sizeof(lval));
+  } else {
+    v = pool_alloc(sizeof(lval));
+    gc_minor_pending = 1;
+  }
+  v->mark = 0;
+  v->rc = 1;
+  return v;
+}
+
+/* Nursery slots are only reclaimed by the next minor collection */
+void lval_free(lval *v) {
+  if (lval_is_young(v)) {
+    v->type = OBJ_FREE;
+    return;
+  }
+  if (v->mark & GC_REMEMBERED) {
+    for (long i = 0; i < gc_remembered_count; i++) {
+      if (gc_remembered[i] == v) {
+        gc_remembered[i] = gc_remembered[--gc_remembered_count];
+        break;
+      }
+    }
+  }
+  pool_free(v, sizeof(lval));
+}
+
 /* Create a new number type lval */
 lval *lval_num(long x) {
-  lval *v = malloc(sizeof(lval));
+  if (x >= FIXNUM_MIN && x <= FIXNUM_MAX) {
+    return (lval *)(((uintptr_t)x << 1) | 1);
+  }
+  lval *v = lval_alloc();
   v->type = LVAL_NUM;
   v->num = x;
-  v->count = 0;
   return v;
 }
 
 /* Create a new error type lval */
 lval *lval_err(char *fmt, ...) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lval_alloc();
   v->type = LVAL_ERR;
 
   /* Create a va list and initialize it */
@@ -83,38 +1003,91 @@ lval *lval_err(char *fmt, ...) {
   return v;
 }
 
+/* Symbols
+ *
+ * Every symbol name is stored once, in an open addressing hash table, and
+ * never freed. Symbols can then be compared by pointer, and creating or
+ * copying a symbol lval does not copy its name. */
+char **sym_table = NULL;
+long sym_table_count = 0;
+long sym_table_capacity = 0;
+
+unsigned long sym_hash(char *name) {
+  /* FNV-1a */
+  unsigned long h = 14695981039346656037UL;
+  for (; *name; name++) {
+    h = (h ^ (unsigned char)*name) * 1099511628211UL;
+  }
+  return h;
+}
+
+/* Slot where `name` is, or should go */
+long sym_table_slot(char **table, long capacity, char *name) {
+  long i = sym_hash(name) & (capacity - 1);
+  while (table[i] && strcmp(table[i], name) != 0) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return i;
+}
+
+/* Get the unique copy of `name` */
+char *sym_intern(char *name) {
+  /* Keep the table at most half full */
+  if (2 * (sym_table_count + 1) > sym_table_capacity) {
+    long capacity = sym_table_capacity ? sym_table_capacity * 2 : 256;
+    char **table = calloc(capacity, sizeof(char *));
+    for (long i = 0; i < sym_table_capacity; i++) {
+      if (sym_table[i]) {
+        table[sym_table_slot(table, capacity, sym_table[i])] = sym_table[i];
+      }
+    }
+    free(sym_table);
+    sym_table = table;
+    sym_table_capacity = capacity;
+  }
+  long i = sym_table_slot(sym_table, sym_table_capacity, name);
+  if (sym_table[i] == NULL) {
+    sym_table[i] = malloc(strlen(name) + 1);
+    strcpy(sym_table[i], name);
+    sym_table_count++;
+  }
+  return sym_table[i];
+}
+
 /* Create a new symbol lval */
 lval *lval_sym(char *x) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lval_alloc();
   v->type = LVAL_SYM;
-  v->sym = malloc(strlen(x) + 1);
-  strcpy(v->sym, x);
-  v->count = 0;
+  v->sym = sym_intern(x);
+  v->scope = SYM_UNRESOLVED;
   return v;
 }
 
 /* Create a new sexpr lval */
 lval *lval_sexpr(void) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lval_alloc();
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->buf = NULL;
+  v->code = NULL;
   return v;
 }
 
 /* Create a new qexpr lval */
 lval *lval_qexpr(void) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lval_alloc();
   v->type = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->buf = NULL;
+  v->code = NULL;
   return v;
 }
 
 lval *lval_builtin(lbuiltin func) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lval_alloc();
   v->type = LVAL_FUN;
-  v->count = 0;
   v->builtin = func;
   return v;
 }
@@ -122,18 +1095,21 @@ lval *lval_builtin(lbuiltin func) {
 lenv *lenv_new(void);
 
 lval *lval_lambda(lval *formals, lval *body) {
-  lval *v = malloc(sizeof(lval));
+  lval *v = lval_alloc();
   v->type = LVAL_FUN;
 
   /* Set Builtin to Null */
   v->builtin = NULL;
 
-  /* Build new environment */
-  v->env = lenv_new();
+  /* Scoping is dynamic, so a lambda captures nothing from where it is
+   * built: its environment only gets allocated once a partial application
+   * binds some of its formals */
+  v->env = NULL;
 
   /* Set Formals and Body */
   v->formals = formals;
   v->body = body;
+  gc_write_barrier_all(v);
   return v;
 }
 
@@ -156,64 +1132,244 @@ char *ltype_name(int t) {
   }
 }
 
-lval *lval_add(lval *parent, lval *child) {
-  parent->count++;
-  parent->cell = realloc(parent->cell, sizeof(lval *) * parent->count);
-  parent->cell[parent->count - 1] = child;
-  return parent;
-}
-
 void lenv_del(lenv *e);
-
-void lval_del(lval *v) {
-  switch (v->type) {
-  case LVAL_NUM:
-    break;
-  case LVAL_ERR:
-    free(v->err);
-    break;
-  case LVAL_SYM:
-    free(v->sym);
-    break;
-  case LVAL_SEXPR:
-  case LVAL_QEXPR:
-    for (int i = 0; i < v->count; i++) {
-      lval_del(v->cell[i]);
-    }
-    free(v->cell);
-    break;
-  case LVAL_FUN:
-    if (v->builtin == NULL) {
-      lenv_del(v->env);
-      lval_del(v->formals);
-      lval_del(v->body);
-    }
-    break;
+void lenv_frame_del(lenv *e);
+lmemo *lmemo_ref(lmemo *m);
+void lmemo_del(lmemo *m);
+void lval_del(lval *v);
+lval *lval_ref(lval *v);
+
+/* Code compiled from a list no longer matches it once the list changes */
+void lval_drop_code(lval *v) {
+  if (v->code == NULL) {
+    return;
   }
-  free(v);
+  for (int i = 0; i < v->code->const_count; i++) {
+    lval_del(v->code->consts[i]);
+  }
+  lcode_free(v->code);
+  v->code = NULL;
 }
 
-void lval_print(lval *v);
-
-void lval_expr_print(lval *v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
-
-    /* Print Value contained within */
-    lval_print(v->cell[i]);
+lbuf *lbuf_new(int capacity) {
+  lbuf *b = malloc(sizeof(lbuf) + sizeof(lval *) * capacity);
+  b->rc = 1;
+  b->start = 0;
+  b->used = 0;
+  b->capacity = capacity;
+  b->young = 0;
+  return b;
+}
 
-    /* Don't print trailing space if last element */
-    if (i != (v->count - 1)) {
-      putchar(' ');
-    }
+void lbuf_release(lbuf *b) {
+  if (b == NULL || --b->rc > 0) {
+    return;
   }
-  putchar(close);
+  for (int i = b->start; i < b->used; i++) {
+    lval_del(b->items[i]);
+  }
+  free(b);
 }
 
-void lval_print(lval *v) {
+/* Make v the only list using its buffer, and make the buffer hold exactly
+ * the children of v, so that its cells can be modified in place. v itself
+ * must not be shared. */
+void lval_own_cells(lval *v) {
+  lval_drop_code(v);
+  lbuf *b = v->buf;
+  if (b == NULL) {
+    return;
+  }
+  if (b->rc > 1) {
+    lbuf *x = lbuf_new(v->count);
+    for (int i = 0; i < v->count; i++) {
+      x->items[i] = lval_ref(v->cell[i]);
+    }
+    x->used = v->count;
+    x->young = b->young;
+    b->rc--;
+    v->buf = x;
+    v->cell = x->items;
+    return;
+  }
+  /* Drop the items this list does not see any more */
+  int first = v->cell - b->items;
+  for (int i = b->start; i < first; i++) {
+    lval_del(b->items[i]);
+  }
+  for (int i = first + v->count; i < b->used; i++) {
+    lval_del(b->items[i]);
+  }
+  b->start = first;
+  b->used = first + v->count;
+}
+
+/* Make room for `n` more children at the end of v, which must not be
+ * shared */
+void lval_reserve(lval *v, int n) {
+  lval_own_cells(v);
+  lbuf *b = v->buf;
+  if (b && b->used + n <= b->capacity) {
+    return;
+  }
+  /* Reuse the space freed at the front if that is enough, grow otherwise */
+  if (b && b->start > 0 && v->count + n <= b->capacity / 2) {
+    memmove(b->items, v->cell, sizeof(lval *) * v->count);
+  } else {
+    int capacity = b ? b->capacity : 4;
+    while (capacity < v->count + n) {
+      capacity *= 2;
+    }
+    lbuf *x = lbuf_new(capacity);
+    if (b) {
+      memcpy(x->items, v->cell, sizeof(lval *) * v->count);
+      x->young = b->young;
+      free(b);
+    }
+    b = v->buf = x;
+  }
+  b->start = 0;
+  b->used = v->count;
+  v->cell = b->items;
+}
+
+lval *lval_add(lval *parent, lval *child) {
+  lval_reserve(parent, 1);
+  parent->cell[parent->count++] = child;
+  parent->buf->used++;
+  gc_write_barrier(parent, child);
+  return parent;
+}
+
+/* Values are shared rather than copied: each owner holds one reference, and
+ * `lval_del` only destroys the value once its last reference is dropped.
+ * A value that may be shared must never be modified in place, call
+ * `lval_unshare` first to get a private version of it. */
+lval *lval_ref(lval *v) {
+  if (!lval_is_fixnum(v)) {
+    v->rc++;
+  }
+  return v;
+}
+
+/* Explicit stacks
+ *
+ * Values can nest deeper than the C stack allows recursing, so traversals
+ * of nested values keep the lists they are in the middle of on a stack of
+ * their own, on the heap: nesting is only limited by memory. */
+typedef struct walk_frame {
+  lval *v;
+  /* The value v is compared with, see `lval_eq` */
+  lval *w;
+  /* Next child of v to visit */
+  int i;
+  /* Traversal specific */
+  int arg;
+} walk_frame;
+
+typedef struct walk {
+  walk_frame *frames;
+  int count;
+  int capacity;
+} walk;
+
+walk_frame *walk_push(walk *w, lval *v) {
+  if (w->count == w->capacity) {
+    w->capacity = w->capacity ? w->capacity * 2 : 16;
+    w->frames = realloc(w->frames, sizeof(walk_frame) * w->capacity);
+  }
+  walk_frame *t = &w->frames[w->count++];
+  t->v = v;
+  t->w = NULL;
+  t->i = 0;
+  t->arg = 0;
+  return t;
+}
+
+walk_frame *walk_top(walk *w) { return &w->frames[w->count - 1]; }
+
+/* Child i of a list or lambda, or NULL past the last one */
+lval *lval_child(lval *v, int i) {
+  switch (lval_type(v)) {
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    return i < v->count ? v->cell[i] : NULL;
+  case LVAL_FUN:
+    if (v->builtin == NULL && i < 2) {
+      return i == 0 ? v->formals : v->body;
+    }
+    if (v->builtin == builtin_memoized && i == 0) {
+      return v->memo->fn;
+    }
+    break;
+  }
+  return NULL;
+}
+
+/* Values whose last reference was dropped, and which still have to
+ * release their children, see `lval_del` */
+lval **lval_dead = NULL;
+long lval_dead_count = 0;
+long lval_dead_capacity = 0;
+int lval_releasing = 0;
+
+void lval_release(lval *v) {
   switch (v->type) {
   case LVAL_NUM:
-    printf("%li", v->num);
+    break;
+  case LVAL_ERR:
+    free(v->err);
+    break;
+  case LVAL_SYM:
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    lval_drop_code(v);
+    lbuf_release(v->buf);
+    break;
+  case LVAL_FUN:
+    if (v->builtin == NULL) {
+      if (v->env) {
+        lenv_frame_del(v->env);
+      }
+      lval_del(v->formals);
+      lval_del(v->body);
+    } else if (v->builtin == builtin_memoized) {
+      lmemo_del(v->memo);
+    }
+    break;
+  }
+  lval_free(v);
+}
+
+/* Releasing a value releases its children, which may release theirs and so
+ * on: rather than recursing, the values to release are queued, and only
+ * the outermost call releases them. */
+void lval_del(lval *v) {
+  if (lval_is_fixnum(v) || --v->rc > 0) {
+    return;
+  }
+  if (lval_dead_count == lval_dead_capacity) {
+    lval_dead_capacity = lval_dead_capacity ? lval_dead_capacity * 2 : 64;
+    lval_dead = realloc(lval_dead, sizeof(lval *) * lval_dead_capacity);
+  }
+  lval_dead[lval_dead_count++] = v;
+  if (lval_releasing) {
+    return;
+  }
+  lval_releasing = 1;
+  while (lval_dead_count > 0) {
+    lval_release(lval_dead[--lval_dead_count]);
+  }
+  lval_releasing = 0;
+}
+
+/* Print v if it has no children, otherwise its opening. Returns whether v
+ * has children to print. */
+int lval_print_open(lval *v) {
+  switch (lval_type(v)) {
+  case LVAL_NUM:
+    printf("%li", lval_num_value(v));
     break;
   case LVAL_ERR:
     printf("Error: %s", v->err);
@@ -222,23 +1378,47 @@ void lval_print(lval *v) {
     printf("%s", v->sym);
     break;
   case LVAL_SEXPR:
-    lval_expr_print(v, '(', ')');
-    break;
+    putchar('(');
+    return 1;
   case LVAL_QEXPR:
-    lval_expr_print(v, '{', '}');
-    break;
+    putchar('{');
+    return 1;
   case LVAL_FUN:
-    if (v->builtin) {
+    if (v->builtin == builtin_memoized) {
+      printf("(memo ");
+      return 1;
+    } else if (v->builtin) {
       printf("<builtin>");
     } else {
       printf("(\\ ");
-      lval_print(v->formals);
-      putchar(' ');
-      lval_print(v->body);
-      putchar(')');
+      return 1;
     }
     break;
   }
+  return 0;
+}
+
+void lval_print(lval *v) {
+  walk w = {0};
+  while (v) {
+    if (lval_print_open(v)) {
+      walk_push(&w, v);
+    }
+    /* Move on to the next child of the innermost unfinished list, closing
+     * the ones which are done */
+    v = NULL;
+    while (w.count > 0 && v == NULL) {
+      walk_frame *t = walk_top(&w);
+      v = lval_child(t->v, t->i);
+      if (v == NULL) {
+        putchar(lval_type(t->v) == LVAL_QEXPR ? '}' : ')');
+        w.count--;
+      } else if (t->i++ > 0) {
+        putchar(' ');
+      }
+    }
+  }
+  free(w.frames);
 }
 
 void lval_println(lval *v) {
@@ -258,7 +1438,46 @@ void lenv_println(lenv *e) {
   putchar('\n');
 }
 
-lval *lval_read(mpc_ast_t *t) {
+void stats_println(void) {
+  printf("lval allocations: %li (%zu bytes each)\n", lval_allocs,
+         sizeof(lval));
+  printf("interned symbols: %li\n", sym_table_count);
+  printf("symbol caches: %li hits, %li misses\n", lenv_cache_hits,
+         lenv_cache_misses);
+  printf("lambda calls: %li compiled, %li walked\n", vm_calls, tree_calls);
+  for (int c = 0; c < POOL_CLASSES; c++) {
+    pool *p = &pools[c];
+    if (p->used == 0 && p->slab_count == 0) {
+      continue;
+    }
+    printf("pool %zu bytes: %li used, %li peak", pool_class_size(c), p->used,
+           p->peak);
+#ifndef LISPY_NO_POOL
+    printf(" / %li slots in %li slabs (%li%%)", p->capacity, p->slab_count,
+           p->capacity ? p->used * 100 / p->capacity : 0);
+#endif
+    putchar('\n');
+  }
+  printf("gc: %li collections, %li bytes collected, %.0f us paused (max %.0f "
+         "us)\n",
+         gc_collections, gc_collected_total, gc_pause_total * 1e6,
+         gc_pause_max * 1e6);
+  printf("gc: %li minor collections, %li values promoted, %li nursery "
+         "releases\n",
+         gc_minor_collections, gc_promoted_total, gc_form_releases);
+  printf("gc pauses (us):  <10 <100  <1k <10k more\n");
+  printf("  minor        ");
+  for (int b = 0; b < GC_BUCKETS; b++) {
+    printf(" %4li", gc_minor_pauses[b]);
+  }
+  printf("\n  major        ");
+  for (int b = 0; b < GC_BUCKETS; b++) {
+    printf(" %4li", gc_major_pauses[b]);
+  }
+  putchar('\n');
+}
+
+lval *lval_read_token(mpc_ast_t *t) {
   if (strstr(t->tag, "number")) {
     errno = 0;
     long x = strtol(t->contents, NULL, 10);
@@ -267,53 +1486,87 @@ lval *lval_read(mpc_ast_t *t) {
   if (strstr(t->tag, "symbol")) {
     return lval_sym(t->contents);
   }
-  lval *v = NULL;
-  if (strcmp(t->tag, ">") == 0 || strstr(t->tag, "sexpr")) {
-    v = lval_sexpr();
-  }
-  if (strstr(t->tag, "qexpr")) {
-    v = lval_qexpr();
-  }
-  for (int i = 0; i < t->children_num; i++) {
-    mpc_ast_t *child = t->children[i];
-    if (strcmp(t->children[i]->contents, "(") == 0) {
+  return NULL;
+}
+
+/* The parser only splits the input in tokens, lists are put together here.
+ * The lists which are still open are kept on a `walk` stack, so that how
+ * deep they nest is only limited by memory. */
+lval *lval_read(mpc_ast_t *t) {
+  walk w = {0};
+  walk_push(&w, lval_sexpr());
+  /* A single token is not wrapped in a node of its own */
+  mpc_ast_t **tokens = t->children_num ? t->children : &t;
+  int count = t->children_num ? t->children_num : 1;
+  lval *err = NULL;
+  for (int i = 0; i < count && err == NULL; i++) {
+    char *s = tokens[i]->contents;
+    lval *v = lval_read_token(tokens[i]);
+    if (strcmp(s, "(") == 0) {
+      walk_push(&w, lval_sexpr());
       continue;
     }
-    if (strcmp(t->children[i]->contents, ")") == 0) {
+    if (strcmp(s, "{") == 0) {
+      walk_push(&w, lval_qexpr());
       continue;
     }
-    if (strcmp(t->children[i]->contents, "{") == 0) {
-      continue;
+    if (strcmp(s, ")") == 0 || strcmp(s, "}") == 0) {
+      int type = s[0] == ')' ? LVAL_SEXPR : LVAL_QEXPR;
+      if (w.count == 1 || walk_top(&w)->v->type != type) {
+        err = lval_err("unexpected '%s'", s);
+        continue;
+      }
+      v = walk_top(&w)->v;
+      w.count--;
     }
-    if (strcmp(t->children[i]->contents, "}") == 0) {
-      continue;
+    if (v) {
+      lval_add(walk_top(&w)->v, v);
     }
-    if (strcmp(t->children[i]->tag, "regex") == 0) {
-      continue;
+  }
+  if (err == NULL && w.count > 1) {
+    err = lval_err("missing '%c'",
+                   walk_top(&w)->v->type == LVAL_SEXPR ? ')' : '}');
+  }
+  lval *v = w.frames[0].v;
+  if (err) {
+    while (w.count > 1) {
+      lval_del(walk_top(&w)->v);
+      w.count--;
     }
-    v = lval_add(v, lval_read(child));
+    lval_del(v);
+    v = err;
   }
+  free(w.frames);
   return v;
 }
 
-lenv *lenv_copy(lenv *e);
+lenv *lenv_ref(lenv *e);
 
+/* Copy the top level of v, its children are shared with the original */
 lval *lval_copy(lval *v) {
 
-  lval *x = malloc(sizeof(lval));
+  /* Fixnums are values, not pointers */
+  if (lval_is_fixnum(v)) {
+    return v;
+  }
+
+  lval *x = lval_alloc();
   x->type = v->type;
 
   switch (v->type) {
 
   /* Copy Functions and Numbers Directly */
   case LVAL_FUN:
-    if (v->builtin != NULL) {
+    if (v->builtin == builtin_memoized) {
+      x->builtin = v->builtin;
+      x->memo = lmemo_ref(v->memo);
+    } else if (v->builtin != NULL) {
       x->builtin = v->builtin;
     } else {
       x->builtin = NULL;
-      x->env = lenv_copy(v->env);
-      x->formals = lval_copy(v->formals);
-      x->body = lval_copy(v->body);
+      x->env = lenv_ref(v->env);
+      x->formals = lval_ref(v->formals);
+      x->body = lval_ref(v->body);
     }
     break;
   case LVAL_NUM:
@@ -327,442 +1580,2086 @@ lval *lval_copy(lval *v) {
     break;
 
   case LVAL_SYM:
-    x->sym = malloc(strlen(v->sym) + 1);
-    strcpy(x->sym, v->sym);
+    x->sym = v->sym;
+    x->scope = v->scope;
+    x->slot = v->slot;
+    x->version = v->version;
+    break;
+
+  /* Copy Lists by sharing their buffer */
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    x->count = v->count;
+    x->cell = v->cell;
+    x->buf = v->buf;
+    x->code = NULL;
+    if (x->buf) {
+      x->buf->rc++;
+    }
     break;
+  }
+
+  gc_write_barrier_all(x);
+  return x;
+}
+
+lenv *lenv_tenure(lenv *e);
 
-  /* Copy Lists by copying each sub-expression */
+/* Copy of v living in the pools, holding references to the same children
+ * as v. Sets *young when some of those children may be in the nursery:
+ * `lval_tenure` then replaces them by their own copies. */
+lval *lval_tenure_shallow(lval *v, int *young) {
+  *young = 0;
+  if (!lval_is_young(v)) {
+    return lval_ref(v);
+  }
+  lval *x = pool_alloc(sizeof(lval));
+  x->type = v->type;
+  x->mark = 0;
+  x->rc = 1;
+
+  switch (v->type) {
+  case LVAL_FUN:
+    x->builtin = v->builtin;
+    if (v->builtin == NULL) {
+      x->env = lenv_tenure(v->env);
+      x->formals = lval_ref(v->formals);
+      x->body = lval_ref(v->body);
+      *young = 1;
+    } else if (v->builtin == builtin_memoized) {
+      x->memo = lmemo_ref(v->memo);
+    }
+    break;
+  case LVAL_NUM:
+    x->num = v->num;
+    break;
+  case LVAL_ERR:
+    x->err = malloc(strlen(v->err) + 1);
+    strcpy(x->err, v->err);
+    break;
+  case LVAL_SYM:
+    x->sym = v->sym;
+    x->scope = v->scope;
+    x->slot = v->slot;
+    x->version = v->version;
+    break;
   case LVAL_SEXPR:
   case LVAL_QEXPR:
     x->count = v->count;
-    x->cell = malloc(sizeof(lval *) * x->count);
-    for (int i = 0; i < x->count; i++) {
-      x->cell[i] = lval_copy(v->cell[i]);
+    x->cell = v->cell;
+    x->buf = v->buf;
+    x->code = NULL;
+    /* Items already out of the nursery can stay where they are */
+    if (x->buf && !x->buf->young) {
+      x->buf->rc++;
+      break;
+    }
+    x->cell = NULL;
+    x->buf = NULL;
+    if (v->count > 0) {
+      x->buf = lbuf_new(v->count);
+      for (int i = 0; i < v->count; i++) {
+        x->buf->items[i] = lval_ref(v->cell[i]);
+      }
+      x->buf->used = v->count;
+      x->cell = x->buf->items;
+      *young = 1;
     }
     break;
   }
+  return x;
+}
+
+/* Where child i of a copy made by `lval_tenure_shallow` is, or NULL past
+ * the last one. The values bound by the environment of a lambda come
+ * first. */
+lval **lval_tenure_slot(lval *x, int i) {
+  if (x->type != LVAL_FUN) {
+    return i < x->count ? &x->cell[i] : NULL;
+  }
+  int bound = x->env ? x->env->count : 0;
+  if (i < bound) {
+    return &x->env->vals[i];
+  }
+  if (i == bound) {
+    return &x->formals;
+  }
+  return i == bound + 1 ? &x->body : NULL;
+}
+
+/* Copy of v living in the pools, with every child that was in the nursery
+ * copied too. Values escaping into the global environment go through
+ * here, so that the nursery can be released without looking at it.
+ *
+ * The copies whose children are still to be copied are kept on a walk
+ * rather than recursed into, so nesting is not limited by the C stack. */
+lval *lval_tenure(lval *v) {
+  int young;
+  lval *x = lval_tenure_shallow(v, &young);
+  if (!young) {
+    return x;
+  }
+  /* Kept from one call to the next */
+  static walk w;
+  w.count = 0;
+  walk_push(&w, x);
+  while (w.count > 0) {
+    walk_frame *t = walk_top(&w);
+    lval **slot = lval_tenure_slot(t->v, t->i++);
+    if (slot == NULL) {
+      w.count--;
+      continue;
+    }
+    lval *y = *slot;
+    *slot = lval_tenure_shallow(y, &young);
+    lval_del(y);
+    if (young) {
+      walk_push(&w, *slot);
+    }
+  }
+  return x;
+}
 
+/* Get a version of v which can be modified in place, consuming v. Values
+ * are only copied when someone else holds a reference to them. */
+lval *lval_unshare(lval *v) {
+  if (lval_is_fixnum(v) || v->rc == 1) {
+    return v;
+  }
+  lval *x = lval_copy(v);
+  lval_del(v);
   return x;
 }
 
+lenv *lenv_ref(lenv *e) {
+  if (e) {
+    e->rc++;
+  }
+  return e;
+}
+
+int lenv_capacity(int count);
+
 lenv *lenv_copy(lenv *e) {
-  lenv *x = malloc(sizeof(lenv));
+  lenv *x = pool_alloc(sizeof(lenv));
+  x->type = OBJ_ENV;
+  x->mark = 0;
+  x->rc = 1;
   x->par = e->par;
   x->count = e->count;
-  x->syms = malloc(sizeof(char *) * x->count);
-  x->vals = malloc(sizeof(lval *) * x->count);
+  x->capacity = lenv_capacity(x->count);
+  x->syms = malloc(sizeof(char *) * x->capacity);
+  x->vals = malloc(sizeof(lval *) * x->capacity);
   for (int i = 0; i < x->count; i++) {
-    x->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(x->syms[i], e->syms[i]);
-    x->vals[i] = lval_copy(e->vals[i]);
+    x->syms[i] = e->syms[i];
+    x->vals[i] = lval_ref(e->vals[i]);
+  }
+  x->index_capacity = e->index_capacity;
+  x->index = NULL;
+  if (e->index) {
+    x->index = malloc(sizeof(int) * e->index_capacity);
+    memcpy(x->index, e->index, sizeof(int) * e->index_capacity);
   }
   return x;
 }
 
-/* removes values from SExpr */
+/* Same as `lval_tenure_shallow`, an environment is only copied when one
+ * of its values is still in the nursery. The copy binds the same values,
+ * which `lval_tenure` then copies out of the nursery. */
+lenv *lenv_tenure(lenv *e) {
+  int young = 0;
+  for (int i = 0; e && i < e->count; i++) {
+    young |= lval_is_young(e->vals[i]);
+  }
+  return young ? lenv_copy(e) : lenv_ref(e);
+}
+
+/* removes values from SExpr, which must not be shared */
 lval *lval_pop(lval *v, int i) {
-  lval *result = v->cell[i];
+  lval *result;
+  lval_drop_code(v);
+
+  if (i == 0 && v->buf->rc > 1) {
+    /* Leave the buffer alone, just stop looking at the first item */
+    result = lval_ref(v->cell[0]);
+    v->cell++;
+  } else {
+    lval_own_cells(v);
+    result = v->cell[i];
+    if (i == 0) {
+      v->cell++;
+      v->buf->start++;
+    } else {
+      memmove(&v->cell[i], &v->cell[i + 1],
+              sizeof(lval *) * (v->count - i - 1));
+      v->buf->used--;
+    }
+  }
+
+  v->count--;
+  return result;
+}
+
+/* take value from SExpr, and free SExpr */
+lval *lval_take(lval *v, int i) {
+  lval *result = lval_pop(v, i);
+  lval_del(v);
+  return result;
+}
+
+lval *builtin_plus(lenv *e, lval *v) {
+  for (int i = 0; i < v->count; i++) {
+    LASSERT(v, lval_type(v->cell[i]) == LVAL_NUM,
+            "Cannot operate on non-number!")
+  }
+  long current_val = 0;
+  for (int i = 0; i < v->count; i++) {
+    current_val += lval_num_value(v->cell[i]);
+  }
+  lval_del(v);
+  return lval_num(current_val);
+}
+
+lval *builtin_minus(lenv *e, lval *v) {
+  for (int i = 0; i < v->count; i++) {
+    LASSERT(v, lval_type(v->cell[i]) == LVAL_NUM,
+            "Cannot operate on non-number!")
+  }
+  long current_val;
+  if (v->count == 1) {
+    current_val = -lval_num_value(v->cell[0]);
+  } else {
+    current_val = lval_num_value(v->cell[0]);
+    for (int i = 1; i < v->count; i++) {
+      current_val -= lval_num_value(v->cell[i]);
+    }
+  }
+  lval_del(v);
+  return lval_num(current_val);
+}
+
+lval *builtin_times(lenv *e, lval *v) {
+  for (int i = 0; i < v->count; i++) {
+    LASSERT(v, lval_type(v->cell[i]) == LVAL_NUM,
+            "Cannot operate on non-number!")
+  }
+  long current_val = 1;
+  for (int i = 0; i < v->count; i++) {
+    current_val *= lval_num_value(v->cell[i]);
+  }
+  lval_del(v);
+  return lval_num(current_val);
+}
+
+lval *builtin_div(lenv *e, lval *v) {
+  for (int i = 0; i < v->count; i++) {
+    LASSERT(v, lval_type(v->cell[i]) == LVAL_NUM,
+            "Cannot operate on non-number!")
+  }
+  long current_val = lval_num_value(v->cell[0]);
+  for (int i = 1; i < v->count; i++) {
+    long x = lval_num_value(v->cell[i]);
+    if (x == 0) {
+      lval_del(v);
+      return lval_err("Division By Zero!");
+    }
+    current_val /= x;
+  }
+  lval_del(v);
+  return lval_num(current_val);
+}
 
-  memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
+/* Entry points for the common case of two small integers, which need no
+ * argument list, see `lval_arith2` */
+lval *builtin_plus2(long x, long y) { return lval_num(x + y); }
+
+lval *builtin_minus2(long x, long y) { return lval_num(x - y); }
+
+lval *builtin_times2(long x, long y) { return lval_num(x * y); }
+
+lval *builtin_div2(long x, long y) {
+  if (y == 0) {
+    return lval_err("Division By Zero!");
+  }
+  return lval_num(x / y);
+}
+
+/* Value of `g a b` when g is an arithmetic builtin and a and b are small
+ * integers, or NULL. a and b are not consumed. */
+lval *lval_arith2(lval *g, lval *a, lval *b) {
+  if (!lval_is_fixnum(a) || !lval_is_fixnum(b) ||
+      lval_type(g) != LVAL_FUN) {
+    return NULL;
+  }
+  long x = lval_num_value(a);
+  long y = lval_num_value(b);
+  if (g->builtin == builtin_plus) {
+    return builtin_plus2(x, y);
+  }
+  if (g->builtin == builtin_minus) {
+    return builtin_minus2(x, y);
+  }
+  if (g->builtin == builtin_times) {
+    return builtin_times2(x, y);
+  }
+  if (g->builtin == builtin_div) {
+    return builtin_div2(x, y);
+  }
+  return NULL;
+}
+
+lval *builtin_list(lenv *e, lval *a) {
+  /* The arguments already are the list */
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+lval *builtin_head(lenv *e, lval *a) {
+  LASSERT(a, (a->count == 1),
+          "Function 'head' passed too many arguments. Got %i, Expected %i.",
+          a->count, 1)
+  LASSERT(a, (lval_type(a->cell[0]) == LVAL_QEXPR),
+          "Function 'head' passed incorrect types. Got %s, Expected %s.",
+          ltype_name(lval_type(a->cell[0])), ltype_name(LVAL_QEXPR))
+  LASSERT(a, (a->cell[0]->count != 0), "Function 'head' passed {}!")
+
+  lval *qexpr = lval_take(a, 0);
+  lval *result = lval_add(lval_qexpr(), lval_ref(qexpr->cell[0]));
+  lval_del(qexpr);
+  return result;
+}
+
+lval *builtin_tail(lenv *e, lval *a) {
+  LASSERT(a, (a->count == 1),
+          "Function 'tail' passed too many arguments. Got %i, Expected %i.",
+          a->count, 1)
+  LASSERT(a, (lval_type(a->cell[0]) == LVAL_QEXPR),
+          "Function 'tail' passed incorrect types. Got %s, Expected %s.",
+          ltype_name(lval_type(a->cell[0])), ltype_name(LVAL_QEXPR))
+  LASSERT(a, (a->cell[0]->count != 0), "Function 'tail' passed {}!")
+
+  lval *qexpr = lval_unshare(lval_take(a, 0));
+  lval *head = lval_pop(qexpr, 0);
+  lval_del(head);
+  return qexpr;
+}
+
+lval *builtin_join(lenv *e, lval *a) {
+  for (int i = 0; i < a->count; i++) {
+    LASSERT(a, lval_type(a->cell[i]) == LVAL_QEXPR,
+            "Function 'join' passed incorrect type!");
+  }
+  /* Append the other lists to the first one */
+  lval *result = lval_unshare(lval_pop(a, 0));
+  for (int i = 0; i < a->count; i++) {
+    lval *qexpr = a->cell[i];
+    lval_reserve(result, qexpr->count);
+    for (int j = 0; j < qexpr->count; j++) {
+      lval_add(result, lval_ref(qexpr->cell[j]));
+    }
+  }
+  lval_del(a);
+  return result;
+}
+lval *lenv_get(lenv *e, lval *k);
+void lenv_put(lenv *e, lval *k, lval *v);
+void lenv_def(lenv *e, lval *k, lval *v);
+
+lval *builtin_var(lenv *e, lval *a, char *func) {
+  LASSERT(a, (a->count >= 2),
+          "Function '%s' should be supplied at least 2 arguments", func)
+  LASSERT(a, (lval_type(a->cell[0]) == LVAL_QEXPR),
+          "Function '%s' should be supplied a QExpr as a first argument", func)
+  LASSERT(a, (a->cell[0]->count == a->count - 1),
+          "Function '%s' should be supplied as much variable names as values "
+          "to assign",
+          func)
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(
+        a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
+        "Function '%s' should be supplied a QExpr with symbols as its children",
+        func)
+  }
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    if (strcmp(func, "def") == 0) {
+      lenv_def(e, a->cell[0]->cell[i], a->cell[i + 1]);
+    } else {
+      lenv_put(e, a->cell[0]->cell[i], a->cell[i + 1]);
+    }
+  }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval *builtin_def(lenv *e, lval *a) { return builtin_var(e, a, "def"); }
+
+lval *builtin_put(lenv *e, lval *a) { return builtin_var(e, a, "="); }
+
+lval *builtin_lambda(lenv *e, lval *a) {
+  LASSERT(a, (a->count == 2),
+          "Lambda passed incorrect number of arguments. Got %i, Expected %i.",
+          a->count, 2)
+  for (int i = 0; i < a->count; i++) {
+    LASSERT(a, lval_type(a->cell[i]) == LVAL_QEXPR,
+            "Lambda definition got incorrect argument type at position %i. Got "
+            "%s, Expected %s.",
+            i, ltype_name(lval_type(a->cell[i])), ltype_name(LVAL_QEXPR))
+  }
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, lval_type(a->cell[0]->cell[i]) == LVAL_SYM,
+            "Lambda definition got incorrect argument type for formal argument "
+            "%i. Got %s, Expected %s.",
+            i, ltype_name(lval_type(a->cell[0]->cell[i])), ltype_name(LVAL_SYM))
+  }
+  lval *formals = lval_pop(a, 0);
+  lval *body = lval_pop(a, 0);
+  lval_del(a);
+  return lval_lambda(formals, body);
+}
+
+/* Frames with more bindings than this are looked up through a hash index,
+ * smaller ones are scanned */
+#define LENV_INDEX_MIN 8
+
+/* Smallest power of two not below count */
+int lenv_capacity(int count) {
+  int capacity = 1;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+/* Symbols are interned, so their address is as good a key as their name */
+long lenv_hash(char *sym, int capacity) {
+  uint64_t h = (uintptr_t)sym >> 3;
+  return (h * 0x9E3779B97F4A7C15ULL >> 32) & (capacity - 1);
+}
+
+void lenv_index_add(lenv *e, int i) {
+  long j = lenv_hash(e->syms[i], e->index_capacity);
+  while (e->index[j]) {
+    j = (j + 1) & (e->index_capacity - 1);
+  }
+  e->index[j] = i + 1;
+}
+
+/* Position of sym in e, or -1 */
+int lenv_find(lenv *e, char *sym) {
+  if (e->index == NULL) {
+    /* Symbols are interned, so comparing pointers is enough */
+    for (int i = 0; i < e->count; i++) {
+      if (e->syms[i] == sym) {
+        return i;
+      }
+    }
+    return -1;
+  }
+  long j = lenv_hash(sym, e->index_capacity);
+  while (e->index[j]) {
+    if (e->syms[e->index[j] - 1] == sym) {
+      return e->index[j] - 1;
+    }
+    j = (j + 1) & (e->index_capacity - 1);
+  }
+  return -1;
+}
+
+/* The environment of `def`, which outlives every frame */
+lenv *lenv_global = NULL;
+
+/* Bumped whenever a frame binds a name which is also global, so that
+ * symbols found in the global environment under an older version may now
+ * be shadowed */
+long lenv_version = 0;
+
+/* Whether slot i of e binds sym */
+int lenv_binds(lenv *e, int i, char *sym) {
+  return i < e->count && e->syms[i] == sym;
+}
+
+/* k is usually a symbol of a lambda body, evaluated over and over: it
+ * remembers the slot it was found at, which is checked before searching.
+ * Scoping is dynamic, so a global binding is only still the right one if
+ * no frame has bound the same name since, which `lenv_version` tells. */
+lval *lenv_get(lenv *e, lval *k) {
+  if (k->scope == SYM_LOCAL && lenv_binds(e, k->slot, k->sym)) {
+    lenv_cache_hits++;
+    return lval_ref(e->vals[k->slot]);
+  }
+  if (k->scope == SYM_GLOBAL && k->version == lenv_version) {
+    lenv_cache_hits++;
+    return lval_ref(lenv_global->vals[k->slot]);
+  }
+  lenv_cache_misses++;
+
+  lenv *current_e = e;
+  while (current_e) {
+    int i;
+    if (current_e->par == NULL && k->scope == SYM_GLOBAL &&
+        lenv_binds(current_e, k->slot, k->sym)) {
+      i = k->slot;
+    } else {
+      i = lenv_find(current_e, k->sym);
+    }
+    /* If it matches, return a reference to the value */
+    if (i >= 0) {
+      k->scope = current_e == e            ? SYM_LOCAL
+                 : current_e->par == NULL ? SYM_GLOBAL
+                                           : SYM_UNRESOLVED;
+      k->slot = i;
+      k->version = lenv_version;
+      return lval_ref(current_e->vals[i]);
+    }
+    current_e = current_e->par;
+  }
+  /* If no symbol found return error */
+  return lval_err("Unbound Symbol %s", k->sym);
+}
+
+/* Bind sym to v in e, taking a new reference to v */
+void lenv_bind(lenv *e, char *sym, lval *v) {
+  /* Keep the nursery free of anything the environment holds on to */
+  v = (e->mark & GC_TENURED) ? lval_tenure(v) : lval_ref(v);
+  int i = lenv_find(e, sym);
+  if (i >= 0) {
+    lval_del(e->vals[i]);
+    e->vals[i] = v;
+    return;
+  }
+
+  if (e != lenv_global && lenv_global && lenv_find(lenv_global, sym) >= 0) {
+    lenv_version++;
+  }
+
+  if (e->count == e->capacity) {
+    e->capacity = e->capacity ? e->capacity * 2 : 1;
+    e->syms = realloc(e->syms, sizeof(char *) * e->capacity);
+    e->vals = realloc(e->vals, sizeof(lval *) * e->capacity);
+  }
+  e->count++;
+  e->syms[e->count - 1] = sym;
+  e->vals[e->count - 1] = v;
+
+  /* Keep the index at most half full */
+  if (e->count > LENV_INDEX_MIN && 2 * e->count > e->index_capacity) {
+    free(e->index);
+    e->index_capacity = lenv_capacity(4 * e->count);
+    e->index = calloc(e->index_capacity, sizeof(int));
+    for (int j = 0; j < e->count; j++) {
+      lenv_index_add(e, j);
+    }
+  } else if (e->index) {
+    lenv_index_add(e, e->count - 1);
+  }
+}
+
+void lenv_put(lenv *e, lval *k, lval *v) { lenv_bind(e, k->sym, v); }
+
+/* Move into e the bindings of frame it does not shadow, and give e the
+ * parent of frame */
+void lenv_frame_merge(lenv *e, lenv *frame) {
+  for (int i = 0; i < frame->count; i++) {
+    if (lenv_find(e, frame->syms[i]) < 0) {
+      lenv_bind(e, frame->syms[i], frame->vals[i]);
+    }
+  }
+  e->par = frame->par;
+}
+
+void lenv_def(lenv *e, lval *k, lval *v) {
+  /* Iterate till e has no parent */
+  while (e->par) {
+    e = e->par;
+  }
+  /* Put value in e */
+  lenv_put(e, k, v);
+}
+
+lval *lval_eval(lenv *e, lval *v);
+
+/* Returns the Q-Expression to evaluate, see `lval_tail_builtin` */
+lval *builtin_eval(lenv *e, lval *a) {
+  LASSERT(a, (a->count == 1), "Function 'eval' passed too many arguments!")
+  LASSERT(a, (lval_type(a->cell[0]) == LVAL_QEXPR),
+          "Function 'eval' passed incorrect type!")
+
+  return lval_take(a, 0);
+}
+
+/* Returns the Q-Expression of the branch to evaluate, see
+ * `lval_tail_builtin` */
+lval *builtin_if(lenv *e, lval *a) {
+  LASSERT(a, (a->count == 3),
+          "Function 'if' passed incorrect number of arguments. Got %i, "
+          "Expected %i.",
+          a->count, 3)
+  LASSERT(a, (lval_type(a->cell[0]) == LVAL_NUM),
+          "Function 'if' passed incorrect type for argument 0. Got %s, "
+          "Expected %s.",
+          ltype_name(lval_type(a->cell[0])), ltype_name(LVAL_NUM))
+  for (int i = 1; i < 3; i++) {
+    LASSERT(a, (lval_type(a->cell[i]) == LVAL_QEXPR),
+            "Function 'if' passed incorrect type for argument %i. Got %s, "
+            "Expected %s.",
+            i, ltype_name(lval_type(a->cell[i])), ltype_name(LVAL_QEXPR))
+  }
+
+  return lval_take(a, lval_num_value(a->cell[0]) ? 1 : 2);
+}
+
+/* Whether x and y are equal, not looking at their children */
+int lval_eq_shallow(lval *x, lval *y) {
+  if (lval_type(x) != lval_type(y)) {
+    return 0;
+  }
+  switch (lval_type(x)) {
+  case LVAL_NUM:
+    return lval_num_value(x) == lval_num_value(y);
+  case LVAL_ERR:
+    return strcmp(x->err, y->err) == 0;
+  case LVAL_SYM:
+    return x->sym == y->sym;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    return x->count == y->count;
+  case LVAL_FUN:
+    if (x->builtin != y->builtin) {
+      return 0;
+    }
+    /* Partial applications are only equal if they share their arguments,
+     * memoized functions if they share their cache. Other builtins leave
+     * env unset. */
+    return (x->builtin != NULL && x->builtin != builtin_memoized) ||
+           x->env == y->env;
+  }
+  return 0;
+}
+
+int lval_eq(lval *x, lval *y) {
+  /* Kept from one comparison to the next */
+  static walk w;
+  w.count = 0;
+  int eq = 1;
+  while (x && (eq = lval_eq_shallow(x, y))) {
+    walk_push(&w, x)->w = y;
+    /* Move on to the next pair of children */
+    x = NULL;
+    while (w.count > 0 && x == NULL) {
+      walk_frame *t = walk_top(&w);
+      x = lval_child(t->v, t->i);
+      y = lval_child(t->w, t->i++);
+      if (x == NULL) {
+        w.count--;
+      }
+    }
+  }
+  return eq;
+}
+
+lval *builtin_ord(lenv *e, lval *a, char *op) {
+  LASSERT(a, (a->count == 2),
+          "Function '%s' passed incorrect number of arguments. Got %i, "
+          "Expected %i.",
+          op, a->count, 2)
+  for (int i = 0; i < 2; i++) {
+    LASSERT(a, (lval_type(a->cell[i]) == LVAL_NUM),
+            "Function '%s' passed incorrect type for argument %i. Got %s, "
+            "Expected %s.",
+            op, i, ltype_name(lval_type(a->cell[i])), ltype_name(LVAL_NUM))
+  }
+  long x = lval_num_value(a->cell[0]);
+  long y = lval_num_value(a->cell[1]);
+  int result;
+  if (strcmp(op, ">") == 0) {
+    result = x > y;
+  } else if (strcmp(op, "<") == 0) {
+    result = x < y;
+  } else if (strcmp(op, ">=") == 0) {
+    result = x >= y;
+  } else {
+    result = x <= y;
+  }
+  lval_del(a);
+  return lval_num(result);
+}
+
+lval *builtin_gt(lenv *e, lval *a) { return builtin_ord(e, a, ">"); }
+lval *builtin_lt(lenv *e, lval *a) { return builtin_ord(e, a, "<"); }
+lval *builtin_ge(lenv *e, lval *a) { return builtin_ord(e, a, ">="); }
+lval *builtin_le(lenv *e, lval *a) { return builtin_ord(e, a, "<="); }
+
+lval *builtin_cmp(lenv *e, lval *a, char *op) {
+  LASSERT(a, (a->count == 2),
+          "Function '%s' passed incorrect number of arguments. Got %i, "
+          "Expected %i.",
+          op, a->count, 2)
+  int result = lval_eq(a->cell[0], a->cell[1]);
+  if (strcmp(op, "!=") == 0) {
+    result = !result;
+  }
+  lval_del(a);
+  return lval_num(result);
+}
+
+lval *builtin_eq(lenv *e, lval *a) { return builtin_cmp(e, a, "=="); }
+lval *builtin_ne(lenv *e, lval *a) { return builtin_cmp(e, a, "!="); }
+
+lval *builtin_gc(lenv *e, lval *a) {
+  LASSERT(a, (a->count == 1), "Function 'gc' passed too many arguments!")
+  LASSERT(a, (lval_type(a->cell[0]) == LVAL_QEXPR),
+          "Function 'gc' passed incorrect type!")
+  lval *settings = a->cell[0];
+  LASSERT(a, (settings->count == 0 || settings->count == 2),
+          "Function 'gc' should be supplied {} or {min-heap growth}")
+  for (int i = 0; i < settings->count; i++) {
+    LASSERT(a, (lval_type(settings->cell[i]) == LVAL_NUM),
+            "Function 'gc' should be supplied numbers as settings")
+  }
+  if (settings->count == 2) {
+    LASSERT(a, (lval_num_value(settings->cell[0]) > 0),
+            "Function 'gc' should be supplied a positive min-heap")
+    LASSERT(a, (lval_num_value(settings->cell[1]) > 100),
+            "Function 'gc' should be supplied a growth above 100")
+    gc_configure(lval_num_value(settings->cell[0]),
+                 lval_num_value(settings->cell[1]));
+  }
+  lval_del(a);
+
+  clock_t start = clock();
+  long bytes = gc_collect();
+  long pause = (clock() - start) * 1000000 / CLOCKS_PER_SEC;
+
+  lval *result = lval_qexpr();
+  lval_add(result, lval_sym("collected"));
+  lval_add(result, lval_num(bytes));
+  lval_add(result, lval_sym("pause"));
+  lval_add(result, lval_num(pause));
+  return result;
+}
+
+/* Memoization
+ *
+ * `memo` wraps a function with a cache of its results, keyed by its
+ * arguments. Only worth it for functions whose result depends on nothing
+ * but their arguments: scoping is dynamic, so the cache cannot tell if a
+ * function reads bindings of its callers. */
+
+/* Entries a memoized function keeps unless `memo` is given a size */
+#define MEMO_SIZE 1024
+
+unsigned long lval_hash_word(unsigned long h, unsigned long x) {
+  /* FNV-1a, a word at a time */
+  return (h ^ x) * 1099511628211UL;
+}
+
+/* Hash of v, not looking at its children */
+unsigned long lval_hash_shallow(unsigned long h, lval *v) {
+  h = lval_hash_word(h, lval_type(v));
+  switch (lval_type(v)) {
+  case LVAL_NUM:
+    return lval_hash_word(h, lval_num_value(v));
+  case LVAL_ERR:
+    return lval_hash_word(h, sym_hash(v->err));
+  case LVAL_SYM:
+    /* Symbols are interned */
+    return lval_hash_word(h, (uintptr_t)v->sym);
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    return lval_hash_word(h, v->count);
+  case LVAL_FUN:
+    h = lval_hash_word(h, (uintptr_t)v->builtin);
+    /* Other builtins leave env unset, see `lval_eq_shallow` */
+    if (v->builtin != NULL && v->builtin != builtin_memoized) {
+      return h;
+    }
+    return lval_hash_word(h, (uintptr_t)v->env);
+  }
+  return h;
+}
+
+/* Structural hash of v: values which `lval_eq` finds equal hash the same */
+unsigned long lval_hash(lval *v) {
+  /* Kept from one call to the next */
+  static walk w;
+  w.count = 0;
+  unsigned long h = 14695981039346656037UL;
+  while (v) {
+    h = lval_hash_shallow(h, v);
+    walk_push(&w, v);
+    /* Move on to the next child, in the same order as `lval_eq` */
+    v = NULL;
+    while (w.count > 0 && v == NULL) {
+      walk_frame *t = walk_top(&w);
+      v = lval_child(t->v, t->i++);
+      if (v == NULL) {
+        w.count--;
+      }
+    }
+  }
+  return h;
+}
+
+lmemo *lmemo_new(lval *fn, int size) {
+  lmemo *m = calloc(1, sizeof(lmemo));
+  m->rc = 1;
+  m->fn = fn;
+  m->size = size;
+  m->newest = -1;
+  m->oldest = -1;
+  return m;
+}
+
+lmemo *lmemo_ref(lmemo *m) {
+  m->rc++;
+  return m;
+}
+
+void lmemo_del(lmemo *m) {
+  if (--m->rc > 0) {
+    return;
+  }
+  lval_del(m->fn);
+  for (int i = 0; i < m->count; i++) {
+    lval_del(m->entries[i].args);
+    lval_del(m->entries[i].value);
+  }
+  free(m->entries);
+  free(m->index);
+  free(m);
+}
+
+long lmemo_slot(lmemo *m, unsigned long hash) {
+  return (hash * 0x9E3779B97F4A7C15ULL >> 32) & (m->index_capacity - 1);
+}
+
+/* Position in index of entry i */
+long lmemo_index_find(lmemo *m, int i) {
+  long j = lmemo_slot(m, m->entries[i].hash);
+  while (m->index[j] != i + 1) {
+    j = (j + 1) & (m->index_capacity - 1);
+  }
+  return j;
+}
+
+void lmemo_index_add(lmemo *m, int i) {
+  long j = lmemo_slot(m, m->entries[i].hash);
+  while (m->index[j]) {
+    j = (j + 1) & (m->index_capacity - 1);
+  }
+  m->index[j] = i + 1;
+}
+
+/* Take entry i out of the index, moving back the entries after it which
+ * could not go in their own slot, so that lookups need no tombstones */
+void lmemo_index_remove(lmemo *m, int i) {
+  long mask = m->index_capacity - 1;
+  long hole = lmemo_index_find(m, i);
+  m->index[hole] = 0;
+  for (long j = (hole + 1) & mask; m->index[j]; j = (j + 1) & mask) {
+    long home = lmemo_slot(m, m->entries[m->index[j] - 1].hash);
+    /* Whether home is cyclically between the hole and j */
+    if (((j - home) & mask) >= ((j - hole) & mask)) {
+      m->index[hole] = m->index[j];
+      m->index[j] = 0;
+      hole = j;
+    }
+  }
+}
+
+/* Position in entries of the result for args, or -1 */
+int lmemo_find(lmemo *m, lval *args, unsigned long hash) {
+  if (m->index == NULL) {
+    return -1;
+  }
+  long j = lmemo_slot(m, hash);
+  while (m->index[j]) {
+    lmemo_entry *x = &m->entries[m->index[j] - 1];
+    if (x->hash == hash && lval_eq(x->args, args)) {
+      return m->index[j] - 1;
+    }
+    j = (j + 1) & (m->index_capacity - 1);
+  }
+  return -1;
+}
+
+void lmemo_unlink(lmemo *m, int i) {
+  lmemo_entry *x = &m->entries[i];
+  if (x->prev >= 0) {
+    m->entries[x->prev].next = x->next;
+  } else {
+    m->newest = x->next;
+  }
+  if (x->next >= 0) {
+    m->entries[x->next].prev = x->prev;
+  } else {
+    m->oldest = x->prev;
+  }
+}
+
+/* Make entry i the most recently used */
+void lmemo_link(lmemo *m, int i) {
+  lmemo_entry *x = &m->entries[i];
+  x->prev = -1;
+  x->next = m->newest;
+  if (m->newest >= 0) {
+    m->entries[m->newest].prev = i;
+  } else {
+    m->oldest = i;
+  }
+  m->newest = i;
+}
+
+void lmemo_grow(lmemo *m) {
+  m->capacity = m->capacity ? m->capacity * 2 : 8;
+  if (m->capacity > m->size) {
+    m->capacity = m->size;
+  }
+  m->entries = realloc(m->entries, sizeof(lmemo_entry) * m->capacity);
+  m->index_capacity = lenv_capacity(2 * m->capacity);
+  free(m->index);
+  m->index = calloc(m->index_capacity, sizeof(int));
+  for (int i = 0; i < m->count; i++) {
+    lmemo_index_add(m, i);
+  }
+}
+
+/* Remember value as the result for args, both tenured. Takes over the
+ * references to them. */
+void lmemo_put(lmemo *m, lval *args, unsigned long hash, lval *value) {
+  int i = lmemo_find(m, args, hash);
+  if (i >= 0) {
+    /* The function called itself with the same arguments */
+    lval_del(args);
+    lval_del(m->entries[i].value);
+    m->entries[i].value = value;
+    return;
+  }
+  if (m->count < m->size) {
+    if (m->count == m->capacity) {
+      lmemo_grow(m);
+    }
+    i = m->count++;
+  } else {
+    i = m->oldest;
+    lmemo_unlink(m, i);
+    lmemo_index_remove(m, i);
+    lval_del(m->entries[i].args);
+    lval_del(m->entries[i].value);
+    m->evictions++;
+  }
+  m->entries[i].hash = hash;
+  m->entries[i].args = args;
+  m->entries[i].value = value;
+  lmemo_link(m, i);
+  lmemo_index_add(m, i);
+}
+
+lval *lval_call(lenv *e, lval *f, lval *v);
+
+/* Call the memoized function f with the arguments v, or look up the
+ * result of an earlier call with equal arguments. Errors are not kept. */
+lval *lval_memo_call(lenv *e, lval *f, lval *v) {
+  lmemo *m = f->memo;
+  unsigned long hash = lval_hash(v);
+  int i = lmemo_find(m, v, hash);
+  if (i >= 0) {
+    m->hits++;
+    lmemo_unlink(m, i);
+    lmemo_link(m, i);
+    lval_del(v);
+    return lval_ref(m->entries[i].value);
+  }
+  m->misses++;
+
+  /* f may be redefined by the call, keep it and its cache around */
+  f = lval_ref(f);
+  lval *args = lval_tenure(v);
+  lval_del(v);
+  int roots = gc_roots_save();
+  gc_push_val(&f);
+  gc_push_val(&args);
+  /* Builtins take their arguments apart, give them a copy */
+  lval *result = lval_call(e, m->fn, lval_copy(args));
+  gc_roots_restore(roots);
+  if (lval_type(result) == LVAL_ERR) {
+    lval_del(args);
+  } else {
+    lval *value = lval_tenure(result);
+    lval_del(result);
+    result = lval_ref(value);
+    lmemo_put(m, args, hash, value);
+  }
+  lval_del(f);
+  return result;
+}
+
+/* Builtin of memoized functions, only there to tell them apart: calls to
+ * them go through `lval_memo_call` */
+lval *builtin_memoized(lenv *e, lval *a) {
+  lval_del(a);
+  return lval_err("Memoized function called without its cache");
+}
+
+lval *builtin_memo(lenv *e, lval *a) {
+  LASSERT(a, (a->count == 1 || a->count == 2),
+          "Function 'memo' should be supplied a function and optionally a "
+          "size")
+  LASSERT(a, (lval_type(a->cell[0]) == LVAL_FUN),
+          "Function 'memo' passed incorrect type!")
+  long size = MEMO_SIZE;
+  if (a->count == 2) {
+    LASSERT(a, (lval_type(a->cell[1]) == LVAL_NUM),
+            "Function 'memo' passed incorrect type!")
+    size = lval_num_value(a->cell[1]);
+    LASSERT(a, (size > 0 && size <= INT_MAX / 4),
+            "Function 'memo' passed an invalid size!")
+  }
+  lval *v = lval_alloc();
+  v->type = LVAL_FUN;
+  v->builtin = builtin_memoized;
+  v->memo = lmemo_new(lval_tenure(a->cell[0]), size);
+  lval_del(a);
+  return v;
+}
+
+lval *builtin_memostats(lenv *e, lval *a) {
+  LASSERT(a, (a->count == 1), "Function 'memostats' passed too many arguments!")
+  LASSERT(a,
+          (lval_type(a->cell[0]) == LVAL_FUN &&
+           a->cell[0]->builtin == builtin_memoized),
+          "Function 'memostats' should be supplied a memoized function")
+  lmemo *m = a->cell[0]->memo;
+  lval *result = lval_qexpr();
+  lval_add(result, lval_sym("hits"));
+  lval_add(result, lval_num(m->hits));
+  lval_add(result, lval_sym("misses"));
+  lval_add(result, lval_num(m->misses));
+  lval_add(result, lval_sym("evictions"));
+  lval_add(result, lval_num(m->evictions));
+  lval_add(result, lval_sym("size"));
+  lval_add(result, lval_num(m->count));
+  lval_del(a);
+  return result;
+}
+
+void lenv_add_single_builtin(lenv *e, lval *k, lval *v) {
+  lenv_put(e, k, v);
+  lval_del(k);
+  lval_del(v);
+}
+
+void lenv_add_builtins(lenv *e) {
+  /* Qexpr builtins */
+  lenv_add_single_builtin(e, lval_sym("list"), lval_builtin(builtin_list));
+  lenv_add_single_builtin(e, lval_sym("head"), lval_builtin(builtin_head));
+  lenv_add_single_builtin(e, lval_sym("tail"), lval_builtin(builtin_tail));
+  lenv_add_single_builtin(e, lval_sym("join"), lval_builtin(builtin_join));
+  lenv_add_single_builtin(e, lval_sym("eval"), lval_builtin(builtin_eval));
+  /* Math builtins */
+  lenv_add_single_builtin(e, lval_sym("+"), lval_builtin(builtin_plus));
+  lenv_add_single_builtin(e, lval_sym("-"), lval_builtin(builtin_minus));
+  lenv_add_single_builtin(e, lval_sym("*"), lval_builtin(builtin_times));
+  lenv_add_single_builtin(e, lval_sym("/"), lval_builtin(builtin_div));
+
+  /* Comparison builtins */
+  lenv_add_single_builtin(e, lval_sym("if"), lval_builtin(builtin_if));
+  lenv_add_single_builtin(e, lval_sym(">"), lval_builtin(builtin_gt));
+  lenv_add_single_builtin(e, lval_sym("<"), lval_builtin(builtin_lt));
+  lenv_add_single_builtin(e, lval_sym(">="), lval_builtin(builtin_ge));
+  lenv_add_single_builtin(e, lval_sym("<="), lval_builtin(builtin_le));
+  lenv_add_single_builtin(e, lval_sym("=="), lval_builtin(builtin_eq));
+  lenv_add_single_builtin(e, lval_sym("!="), lval_builtin(builtin_ne));
+
+  /* Other */
+  lenv_add_single_builtin(e, lval_sym("def"), lval_builtin(builtin_def));
+  lenv_add_single_builtin(e, lval_sym("="), lval_builtin(builtin_put));
+  lenv_add_single_builtin(e, lval_sym("\\"), lval_builtin(builtin_lambda));
+  lenv_add_single_builtin(e, lval_sym("gc"), lval_builtin(builtin_gc));
+  lenv_add_single_builtin(e, lval_sym("memo"), lval_builtin(builtin_memo));
+  lenv_add_single_builtin(e, lval_sym("memostats"),
+                          lval_builtin(builtin_memostats));
+}
+
+lenv *lenv_frame(lenv *par, int count);
+
+/* Bytecode
+ *
+ * A lambda body is compiled on the first call of the lambda into code for
+ * a stack machine: evaluating a child of an S-Expression pushes its value,
+ * and OP_CALL n replaces the n values of an S-Expression by the result of
+ * applying the first to the others, as `lval_eval_sexpr` does. Formals are
+ * read from their slot in the call frame instead of being looked up.
+ * Expressions built at runtime and given to `eval` are still walked. */
+
+void lcode_emit(lcode *c, int op, int arg) {
+  if (c->count + 2 > c->capacity) {
+    c->capacity = c->capacity ? c->capacity * 2 : 16;
+    c->ops = realloc(c->ops, sizeof(int) * c->capacity);
+  }
+  c->ops[c->count++] = op;
+  c->ops[c->count++] = arg;
+}
+
+int lcode_const(lcode *c, lval *v) {
+  c->const_count++;
+  c->consts = realloc(c->consts, sizeof(lval *) * c->const_count);
+  c->consts[c->const_count - 1] = lval_ref(v);
+  return c->const_count - 1;
+}
+
+/* Constant folding
+ *
+ * Subexpressions which only apply pure builtins to literals, such as
+ * `(* 60 60 24)`, are computed once when the body is compiled, by calling
+ * the builtins the global environment binds them to. Scoping is dynamic,
+ * so a call may still see other functions under these names: the folded
+ * value is only used after checking that each of them is bound to the
+ * same builtin as at compile time. Subexpressions nesting deeper than
+ * LCODE_FOLD_DEPTH are not folded. */
+#define LCODE_FOLD_DEPTH 32
+
+int lval_pure_builtin(lbuiltin b) {
+  return b == builtin_plus || b == builtin_minus || b == builtin_times ||
+         b == builtin_div || b == builtin_gt || b == builtin_lt ||
+         b == builtin_ge || b == builtin_le || b == builtin_eq ||
+         b == builtin_ne || b == builtin_list || b == builtin_head ||
+         b == builtin_tail || b == builtin_join;
+}
+
+/* Value of v if it can be folded, NULL otherwise. The symbols it relies
+ * on are added to the guards of fold. */
+lval *lcode_fold_value(lcode *c, lfold *fold, lval *v, int depth) {
+  if (depth > LCODE_FOLD_DEPTH || v->count < 2 ||
+      lval_type(v->cell[0]) != LVAL_SYM) {
+    return NULL;
+  }
+  lval *op = v->cell[0];
+  int i = lenv_find(lenv_global, op->sym);
+  lval *g = i >= 0 ? lenv_global->vals[i] : NULL;
+  if (g == NULL || lval_type(g) != LVAL_FUN || g->builtin == NULL ||
+      !lval_pure_builtin(g->builtin)) {
+    return NULL;
+  }
+
+  lval *args = lval_sexpr();
+  for (int j = 1; j < v->count; j++) {
+    lval *x = v->cell[j];
+    switch (lval_type(x)) {
+    case LVAL_NUM:
+    case LVAL_ERR:
+    case LVAL_QEXPR:
+      /* Literals evaluate to themselves */
+      x = lval_ref(x);
+      break;
+    case LVAL_SEXPR:
+      x = lcode_fold_value(c, fold, x, depth + 1);
+      break;
+    default:
+      x = NULL;
+      break;
+    }
+    if (x == NULL) {
+      lval_del(args);
+      return NULL;
+    }
+    lval_add(args, x);
+  }
+
+  fold->guard_count++;
+  fold->guards = realloc(fold->guards, sizeof(int) * fold->guard_count);
+  fold->builtins =
+      realloc(fold->builtins, sizeof(lbuiltin) * fold->guard_count);
+  fold->guards[fold->guard_count - 1] = lcode_const(c, op);
+  fold->builtins[fold->guard_count - 1] = g->builtin;
+
+  /* As `lval_eval_args`, the first error is the value */
+  for (int j = 0; j < args->count; j++) {
+    if (lval_type(args->cell[j]) == LVAL_ERR) {
+      return lval_take(args, j);
+    }
+  }
+  return g->builtin(lenv_global, args);
+}
+
+/* Fold v if possible, returning the index of the fold in c or -1 */
+int lcode_fold(lcode *c, lval *v) {
+  lfold fold = {0};
+  lval *x = lcode_fold_value(c, &fold, v, 0);
+  if (x == NULL) {
+    free(fold.guards);
+    free(fold.builtins);
+    return -1;
+  }
+  fold.value = lcode_const(c, x);
+  lval_del(x);
+  /* Keep an S-Expression to evaluate, a lambda body being a Q-Expression */
+  x = lval_copy(v);
+  x->type = LVAL_SEXPR;
+  fold.expr = lcode_const(c, x);
+  lval_del(x);
+  c->fold_count++;
+  c->folds = realloc(c->folds, sizeof(lfold) * c->fold_count);
+  c->folds[c->fold_count - 1] = fold;
+  return c->fold_count - 1;
+}
+
+/* Value of the fold i of c in the frame e */
+lval *lcode_folded(lcode *c, int i, lenv *e) {
+  lfold *fold = &c->folds[i];
+  int valid = 1;
+  for (int j = 0; j < fold->guard_count && valid; j++) {
+    lval *g = lenv_get(e, c->consts[fold->guards[j]]);
+    valid = lval_type(g) == LVAL_FUN && g->builtin == fold->builtins[j];
+    lval_del(g);
+  }
+  if (valid) {
+    return lval_ref(c->consts[fold->value]);
+  }
+  return lval_eval(e, lval_ref(c->consts[fold->expr]));
+}
+
+/* Emit code pushing the value of v, which is not an S-Expression */
+void lcode_compile(lcode *c, lval *v) {
+  if (lval_type(v) == LVAL_SYM) {
+    for (int i = 0; i < c->formal_count; i++) {
+      if (c->formals[i] == v->sym) {
+        lcode_emit(c, OP_LOCAL, i);
+        return;
+      }
+    }
+    lcode_emit(c, OP_LOOKUP, lcode_const(c, v));
+    return;
+  }
+  /* Everything else evaluates to itself */
+  lcode_emit(c, OP_CONST, lcode_const(c, v));
+}
+
+/* Emit code pushing the value of the list v. When tail is set, v is the
+ * result of the body, and a call it makes can replace the current one.
+ * Nested S-Expressions are kept on a `walk` stack rather than recursed
+ * into. */
+void lcode_compile_sexpr(lcode *c, lval *v, int tail) {
+  int fold = lcode_fold(c, v);
+  if (fold >= 0) {
+    lcode_emit(c, OP_FOLD, fold);
+    return;
+  }
+  walk w = {0};
+  walk_push(&w, v)->arg = tail;
+  while (w.count > 0) {
+    walk_frame *t = walk_top(&w);
+    lval *x = t->v;
+    if (t->i < x->count) {
+      lval *y = x->cell[t->i++];
+      int fold = lval_type(y) == LVAL_SEXPR ? lcode_fold(c, y) : -1;
+      if (fold >= 0) {
+        lcode_emit(c, OP_FOLD, fold);
+      } else if (lval_type(y) == LVAL_SEXPR) {
+        /* A single value is the result as is */
+        int y_tail = x->count == 1 && t->arg;
+        walk_push(&w, y)->arg = y_tail;
+      } else {
+        lcode_compile(c, y);
+      }
+      continue;
+    }
+    if (x->count == 0) {
+      lcode_emit(c, OP_EMPTY, 0);
+    } else if (x->count > 1) {
+      lcode_emit(c, t->arg ? OP_TAILCALL : OP_CALL, x->count);
+    }
+    w.count--;
+  }
+  free(w.frames);
+}
+
+cnode *cnode_compile_list(lcode *c, lval *v, int depth);
+
+/* Number of formals of the lambda f, counting those a partial application
+ * already bound */
+int lval_formal_count(lval *f) {
+  return (f->env ? f->env->count : 0) + f->formals->count;
+}
+
+/* Name of the formal i of f, in the order its frame binds them: the bound
+ * ones first, then the remaining ones */
+char *lval_formal(lval *f, int i) {
+  int bound = f->env ? f->env->count : 0;
+  return i < bound ? f->env->syms[i] : f->formals->cell[i - bound]->sym;
+}
+
+lcode *lval_compile(lval *f) {
+  lval *body = f->body;
+  int count = lval_formal_count(f);
+  lcode *c = calloc(1, sizeof(lcode));
+  /* With a repeated formal, slots do not match positions in formals */
+  int distinct = 1;
+  for (int i = 0; i < count; i++) {
+    for (int j = 0; j < i; j++) {
+      distinct &= lval_formal(f, i) != lval_formal(f, j);
+    }
+  }
+  if (distinct) {
+    c->formal_count = count;
+    c->formals = malloc(sizeof(char *) * count);
+    for (int i = 0; i < count; i++) {
+      c->formals[i] = lval_formal(f, i);
+    }
+  }
+#ifdef LISPY_CLOSURES
+  c->tree = cnode_compile_list(c, body, 0);
+  if (c->tree) {
+    return c;
+  }
+#endif
+  lcode_compile_sexpr(c, body, 1);
+  lcode_emit(c, OP_RETURN, 0);
+  return c;
+}
+
+/* Code for the body of f, compiled on its first call, or NULL if the body
+ * must be walked instead */
+lcode *lval_code(lval *f) {
+#ifdef LISPY_NO_VM
+  return NULL;
+#else
+  lval *body = f->body;
+  if (body->code == NULL) {
+    body->code = lval_compile(f);
+    gc_write_barrier_all(body);
+  }
+  /* Several lambdas may share a body, but not always their formals */
+  lcode *c = body->code;
+  if (c->formal_count != 0 && c->formal_count != lval_formal_count(f)) {
+    return NULL;
+  }
+  for (int i = 0; i < c->formal_count; i++) {
+    if (c->formals[i] != lval_formal(f, i)) {
+      return NULL;
+    }
+  }
+  return c;
+#endif
+}
+
+void vm_push(lval *v) {
+  if (vm_sp == vm_capacity) {
+    vm_capacity = vm_capacity ? vm_capacity * 2 : 256;
+    vm_stack = realloc(vm_stack, sizeof(lval *) * vm_capacity);
+  }
+  vm_stack[vm_sp++] = v;
+}
+
+/* Pop the n values of an S-Expression off the stack. Returns its value if
+ * it is not a call, otherwise sets *f to the function and returns its
+ * arguments, as `lval_eval_args` does */
+lval *vm_pop_call(int n, lval **f) {
+  lval **args = &vm_stack[vm_sp - n];
+  lval *result = NULL;
+  *f = NULL;
+  if (n == 3 && (result = lval_arith2(args[0], args[1], args[2]))) {
+    /* The operands are small integers, which need no releasing */
+    lval_del(args[0]);
+    vm_sp -= n;
+    return result;
+  }
+  for (int i = 0; i < n && result == NULL; i++) {
+    if (lval_type(args[i]) == LVAL_ERR) {
+      result = lval_ref(args[i]);
+    }
+  }
+  if (result == NULL && lval_type(args[0]) != LVAL_FUN) {
+    result = lval_err("first element is not a function");
+  }
+  if (result) {
+    for (int i = 0; i < n; i++) {
+      lval_del(args[i]);
+    }
+    vm_sp -= n;
+    return result;
+  }
+
+  lval *v = lval_sexpr();
+  v->buf = lbuf_new(n - 1);
+  memcpy(v->buf->items, &args[1], sizeof(lval *) * (n - 1));
+  v->buf->used = v->count = n - 1;
+  v->cell = v->buf->items;
+  for (int i = 1; i < n; i++) {
+    gc_write_barrier(v, args[i]);
+  }
+  *f = args[0];
+  vm_sp -= n;
+  return v;
+}
+
+/* Run c in the frame e. Returns the value of the body, or, when it ends
+ * with a call, sets *f to the function and returns the arguments for
+ * `lval_call` to apply in place of the current call. */
+lval *vm_run(lcode *c, lenv *e, lval **f) {
+  int roots = gc_roots_save();
+  gc_push_env(e);
+  *f = NULL;
+  for (int pc = 0;; pc += 2) {
+    int arg = c->ops[pc + 1];
+    lval *v;
+    switch (c->ops[pc]) {
+    case OP_CONST:
+      vm_push(lval_ref(c->consts[arg]));
+      break;
+    case OP_LOOKUP:
+      vm_push(lenv_get(e, c->consts[arg]));
+      break;
+    case OP_LOCAL:
+      vm_push(lval_ref(e->vals[arg]));
+      break;
+    case OP_EMPTY:
+      vm_push(lval_sexpr());
+      break;
+    case OP_FOLD:
+      vm_push(lcode_folded(c, arg, e));
+      break;
+    case OP_CALL:
+      /* Collect while every value is on the stack */
+      gc_maybe_collect();
+      lval *g;
+      v = vm_pop_call(arg, &g);
+      if (g == NULL) {
+        vm_push(v);
+        break;
+      }
+      /* The function stays on the stack until the call returns */
+      vm_push(g);
+      v = lval_call(e, g, v);
+      lval_del(vm_stack[vm_sp - 1]);
+      vm_stack[vm_sp - 1] = v;
+      break;
+    case OP_TAILCALL:
+      gc_maybe_collect();
+      v = vm_pop_call(arg, f);
+      gc_roots_restore(roots);
+      return v;
+    case OP_RETURN:
+      gc_roots_restore(roots);
+      return vm_stack[--vm_sp];
+    }
+  }
+}
+
+/* Closures
+ *
+ * Built with -DLISPY_CLOSURES, lambda bodies are compiled into a tree of
+ * nodes rather than into bytecode. A node computes its value through its
+ * own function pointer, chosen for the shape of the expression when it is
+ * compiled: a constant, a formal, a lookup, a call, an `if`, or a
+ * comparison or an addition of two operands which make no call. Running a
+ * body is then a chain of indirect calls, with no opcode to dispatch on.
+ *
+ * As in `vm_run`, the values of the children of a call are pushed on the VM
+ * stack while the others are computed. A node is given f when it is the
+ * result of the body: it then hands the call it makes back to `lval_call`
+ * through f rather than making it. The `if` and operator nodes check that
+ * their symbol is still bound to the builtin, and make the call as usual
+ * otherwise. Bodies nesting deeper than CNODE_MAX_DEPTH run as bytecode. */
+#define CNODE_MAX_DEPTH 256
+
+typedef lval *(*crun)(cnode *n, lenv *e, lval **f);
+
+struct cnode {
+  crun run;
+  /* The constants are in code */
+  lcode *code;
+  /* Slot of a formal, or index in consts */
+  int arg;
+  /* Builtin an `if` or operator node was compiled for */
+  lbuiltin builtin;
+  /* Values of the expression, the function first */
+  int count;
+  /* The values, then the branches of an `if` */
+  int kid_count;
+  cnode **kids;
+};
+
+cnode *cnode_new(lcode *c, crun run, int kid_count) {
+  cnode *n = calloc(1, sizeof(cnode));
+  n->run = run;
+  n->code = c;
+  n->kid_count = kid_count;
+  n->kids = calloc(kid_count, sizeof(cnode *));
+  return n;
+}
+
+void cnode_free(cnode *n) {
+  if (n == NULL) {
+    return;
+  }
+  for (int i = 0; i < n->kid_count; i++) {
+    cnode_free(n->kids[i]);
+  }
+  free(n->kids);
+  free(n);
+}
+
+lval *cnode_const(cnode *n, lenv *e, lval **f) {
+  return lval_ref(n->code->consts[n->arg]);
+}
 
-  v->count--;
+lval *cnode_local(cnode *n, lenv *e, lval **f) {
+  return lval_ref(e->vals[n->arg]);
+}
 
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-  return result;
+lval *cnode_lookup(cnode *n, lenv *e, lval **f) {
+  return lenv_get(e, n->code->consts[n->arg]);
 }
 
-/* take value from SExpr, and free SExpr */
-lval *lval_take(lval *v, int i) {
-  lval *result = lval_pop(v, i);
-  lval_del(v);
-  return result;
+lval *cnode_empty(cnode *n, lenv *e, lval **f) { return lval_sexpr(); }
+
+lval *cnode_fold(cnode *n, lenv *e, lval **f) {
+  return lcode_folded(n->code, n->arg, e);
 }
 
-lval *builtin_plus(lenv *e, lval *v) {
-  for (int i = 0; i < v->count; i++) {
-    LASSERT(v->cell[i], v->cell[i]->type == LVAL_NUM,
-            "Cannot operate on non-number!")
+/* Apply the n values on top of the VM stack, or hand them to `lval_call`
+ * through f */
+lval *cnode_apply(int n, lenv *e, lval **f) {
+  /* Collect while every value is on the stack */
+  gc_maybe_collect();
+  if (f) {
+    return vm_pop_call(n, f);
   }
-  long current_val = 0;
-  while (v->count > 0) {
-    lval *x = lval_pop(v, 0);
-    current_val += x->num;
-    lval_del(x);
+  lval *g;
+  lval *v = vm_pop_call(n, &g);
+  if (g == NULL) {
+    return v;
   }
-  lval_del(v);
-  return lval_num(current_val);
+  /* The function stays on the stack until the call returns */
+  vm_push(g);
+  v = lval_call(e, g, v);
+  lval_del(vm_stack[--vm_sp]);
+  return v;
 }
 
-lval *builtin_minus(lenv *e, lval *v) {
-  for (int i = 0; i < v->count; i++) {
-    LASSERT(v->cell[i], v->cell[i]->type == LVAL_NUM,
-            "Cannot operate on non-number!")
-  }
-  long current_val;
-  if (v->count == 1) {
-    lval *x = lval_pop(v, 0);
-    current_val = -x->num;
-    lval_del(x);
-  } else {
-    lval *x = lval_pop(v, 0);
-    current_val = x->num;
-    lval_del(x);
-    while (v->count > 0) {
-      lval *x = lval_pop(v, 0);
-      current_val -= x->num;
-      lval_del(x);
-    }
+lval *cnode_call(cnode *n, lenv *e, lval **f) {
+  for (int i = 0; i < n->count; i++) {
+    vm_push(n->kids[i]->run(n->kids[i], e, NULL));
   }
-  lval_del(v);
-  return lval_num(current_val);
+  return cnode_apply(n->count, e, f);
 }
 
-lval *builtin_times(lenv *e, lval *v) {
-  for (int i = 0; i < v->count; i++) {
-    LASSERT(v->cell[i], v->cell[i]->type == LVAL_NUM,
-            "Cannot operate on non-number!")
+/* `if cond {then} {else}`, the branches being compiled too */
+lval *cnode_if(cnode *n, lenv *e, lval **f) {
+  vm_push(n->kids[0]->run(n->kids[0], e, NULL));
+  vm_push(n->kids[1]->run(n->kids[1], e, NULL));
+  lval *g = vm_stack[vm_sp - 2];
+  lval *cond = vm_stack[vm_sp - 1];
+  if (lval_type(g) == LVAL_FUN && g->builtin == builtin_if &&
+      lval_type(cond) == LVAL_NUM) {
+    cnode *branch = lval_num_value(cond) ? n->kids[4] : n->kids[5];
+    vm_sp -= 2;
+    lval_del(g);
+    lval_del(cond);
+    return branch->run(branch, e, f);
   }
-  long current_val = 1;
-  while (v->count > 0) {
-    lval *x = lval_pop(v, 0);
-    current_val *= x->num;
-    lval_del(x);
+  for (int i = 2; i < n->count; i++) {
+    vm_push(n->kids[i]->run(n->kids[i], e, NULL));
   }
-  lval_del(v);
-  return lval_num(current_val);
+  return cnode_apply(n->count, e, f);
 }
 
-lval *builtin_div(lenv *e, lval *v) {
-  for (int i = 0; i < v->count; i++) {
-    LASSERT(v->cell[i], v->cell[i]->type == LVAL_NUM,
-            "Cannot operate on non-number!")
-  }
-  lval *x = lval_pop(v, 0);
-  long current_val = x->num;
-  while (v->count > 0) {
-    x = lval_pop(v, 0);
-    if (x->num == 0) {
-      lval_del(x);
-      lval_del(v);
-      return lval_err("Division By Zero!");
-    }
-    current_val /= x->num;
-    lval_del(x);
+/* Operands of `op x y`, when op still is the builtin of n and x and y are
+ * small integers. Otherwise the call is made, and its value is put in
+ * *result. */
+int cnode_operands(cnode *n, lenv *e, lval **f, long *x, long *y,
+                   lval **result) {
+  /* The operands make no call, so nothing moves until they are pushed */
+  lval *g = n->kids[0]->run(n->kids[0], e, NULL);
+  lval *a = n->kids[1]->run(n->kids[1], e, NULL);
+  lval *b = n->kids[2]->run(n->kids[2], e, NULL);
+  if (lval_type(g) == LVAL_FUN && g->builtin == n->builtin &&
+      lval_is_fixnum(a) && lval_is_fixnum(b)) {
+    lval_del(g);
+    *x = lval_num_value(a);
+    *y = lval_num_value(b);
+    return 1;
   }
-  lval_del(v);
-  return lval_num(current_val);
+  vm_push(g);
+  vm_push(a);
+  vm_push(b);
+  *result = cnode_apply(3, e, f);
+  return 0;
 }
 
-lval *builtin_list(lenv *e, lval *a) {
-  lval *result = lval_qexpr();
-  while (a->count > 0) {
-    lval_add(result, lval_pop(a, 0));
-  }
-  lval_del(a);
-  return result;
+lval *cnode_add(cnode *n, lenv *e, lval **f) {
+  long x, y;
+  lval *v;
+  return cnode_operands(n, e, f, &x, &y, &v) ? lval_num(x + y) : v;
 }
 
-lval *builtin_head(lenv *e, lval *a) {
-  LASSERT(a, (a->count == 1),
-          "Function 'head' passed too many arguments. Got %i, Expected %i.",
-          a->count, 1)
-  LASSERT(a, (a->cell[0]->type == LVAL_QEXPR),
-          "Function 'head' passed incorrect types. Got %s, Expected %s.",
-          ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR))
-  LASSERT(a, (a->cell[0]->count != 0), "Function 'head' passed {}!")
+lval *cnode_sub(cnode *n, lenv *e, lval **f) {
+  long x, y;
+  lval *v;
+  return cnode_operands(n, e, f, &x, &y, &v) ? lval_num(x - y) : v;
+}
 
-  lval *qexpr = lval_take(a, 0);
-  while (qexpr->count > 1) {
-    lval_pop(qexpr, 1);
-  }
-  return qexpr;
+lval *cnode_gt(cnode *n, lenv *e, lval **f) {
+  long x, y;
+  lval *v;
+  return cnode_operands(n, e, f, &x, &y, &v) ? lval_num(x > y) : v;
 }
 
-lval *builtin_tail(lenv *e, lval *a) {
-  LASSERT(a, (a->count == 1),
-          "Function 'tail' passed too many arguments. Got %i, Expected %i.",
-          a->count, 1)
-  LASSERT(a, (a->cell[0]->type == LVAL_QEXPR),
-          "Function 'tail' passed incorrect types. Got %s, Expected %s.",
-          ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR))
-  LASSERT(a, (a->cell[0]->count != 0), "Function 'tail' passed {}!")
+lval *cnode_lt(cnode *n, lenv *e, lval **f) {
+  long x, y;
+  lval *v;
+  return cnode_operands(n, e, f, &x, &y, &v) ? lval_num(x < y) : v;
+}
 
-  lval *qexpr = lval_take(a, 0);
-  lval *head = lval_pop(qexpr, 0);
-  lval_del(head);
-  return qexpr;
+lval *cnode_ge(cnode *n, lenv *e, lval **f) {
+  long x, y;
+  lval *v;
+  return cnode_operands(n, e, f, &x, &y, &v) ? lval_num(x >= y) : v;
 }
 
-lval *builtin_join(lenv *e, lval *a) {
-  for (int i = 0; i < a->count; i++) {
-    LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
-            "Function 'join' passed incorrect type!");
-  }
-  lval *result = lval_qexpr();
-  while (a->count > 0) {
-    lval *qexpr = lval_pop(a, 0);
-    while (qexpr->count > 0) {
-      lval_add(result, lval_pop(qexpr, 0));
-    }
-    lval_del(qexpr);
-  }
-  lval_del(a);
-  return result;
+lval *cnode_le(cnode *n, lenv *e, lval **f) {
+  long x, y;
+  lval *v;
+  return cnode_operands(n, e, f, &x, &y, &v) ? lval_num(x <= y) : v;
 }
-lval *lenv_get(lenv *e, lval *k);
-void lenv_put(lenv *e, lval *k, lval *v);
-void lenv_def(lenv *e, lval *k, lval *v);
 
-lval *builtin_var(lenv *e, lval *a, char *func) {
-  LASSERT(a, (a->count >= 2),
-          "Function '%s' should be supplied at least 2 arguments", func)
-  LASSERT(a, (a->cell[0]->type == LVAL_QEXPR),
-          "Function '%s' should be supplied a QExpr as a first argument", func)
-  LASSERT(a, (a->cell[0]->count == a->count - 1),
-          "Function '%s' should be supplied as much variable names as values "
-          "to assign",
-          func)
-  for (int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(
-        a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-        "Function '%s' should be supplied a QExpr with symbols as its children",
-        func)
-  }
-  for (int i = 0; i < a->cell[0]->count; i++) {
-    if (strcmp(func, "def") == 0) {
-      lenv_def(e, a->cell[0]->cell[i], a->cell[i + 1]);
-    } else {
-      lenv_put(e, a->cell[0]->cell[i], a->cell[i + 1]);
-    }
-  }
-  lval_del(a);
-  return lval_sexpr();
+lval *cnode_eq(cnode *n, lenv *e, lval **f) {
+  long x, y;
+  lval *v;
+  return cnode_operands(n, e, f, &x, &y, &v) ? lval_num(x == y) : v;
 }
 
-lval *builtin_def(lenv *e, lval *a) { return builtin_var(e, a, "def"); }
+lval *cnode_ne(cnode *n, lenv *e, lval **f) {
+  long x, y;
+  lval *v;
+  return cnode_operands(n, e, f, &x, &y, &v) ? lval_num(x != y) : v;
+}
 
-lval *builtin_put(lenv *e, lval *a) { return builtin_var(e, a, "="); }
+/* Operators with a node of their own */
+struct {
+  char *sym;
+  lbuiltin builtin;
+  crun run;
+} cnode_ops[] = {
+    {"+", builtin_plus, cnode_add}, {"-", builtin_minus, cnode_sub},
+    {">", builtin_gt, cnode_gt},    {"<", builtin_lt, cnode_lt},
+    {">=", builtin_ge, cnode_ge},   {"<=", builtin_le, cnode_le},
+    {"==", builtin_eq, cnode_eq},   {"!=", builtin_ne, cnode_ne},
+};
 
-lval *builtin_lambda(lenv *e, lval *a) {
-  LASSERT(a, (a->count == 2),
-          "Lambda passed incorrect number of arguments. Got %i, Expected %i.",
-          a->count, 2)
-  for (int i = 0; i < a->count; i++) {
-    LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
-            "Lambda definition got incorrect argument type at position %i. Got "
-            "%s, Expected %s.",
-            i, ltype_name(a->cell[i]->type), ltype_name(LVAL_QEXPR))
+cnode *cnode_compile(lcode *c, lval *v, int depth) {
+  if (lval_type(v) == LVAL_SEXPR) {
+    return cnode_compile_list(c, v, depth);
   }
-  for (int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
-            "Lambda definition got incorrect argument type for formal argument "
-            "%i. Got %s, Expected %s.",
-            i, ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM))
+  cnode *n = cnode_new(c, cnode_const, 0);
+  if (lval_type(v) == LVAL_SYM) {
+    for (int i = 0; i < c->formal_count; i++) {
+      if (c->formals[i] == v->sym) {
+        n->run = cnode_local;
+        n->arg = i;
+        return n;
+      }
+    }
+    n->run = cnode_lookup;
   }
-  lval *formals = lval_pop(a, 0);
-  lval *body = lval_pop(a, 0);
-  lval_del(a);
-  return lval_lambda(formals, body);
+  n->arg = lcode_const(c, v);
+  return n;
 }
 
-lval *lenv_get(lenv *e, lval *k) {
+/* Compile the list v as an S-Expression. Returns NULL if it nests too
+ * deep. */
+cnode *cnode_compile_list(lcode *c, lval *v, int depth) {
+  if (depth > CNODE_MAX_DEPTH) {
+    return NULL;
+  }
+  int fold = lcode_fold(c, v);
+  if (fold >= 0) {
+    cnode *n = cnode_new(c, cnode_fold, 0);
+    n->arg = fold;
+    return n;
+  }
+  if (v->count == 0) {
+    return cnode_new(c, cnode_empty, 0);
+  }
+  /* A single value is the result as is */
+  if (v->count == 1) {
+    return cnode_compile(c, v->cell[0], depth + 1);
+  }
 
-  lenv *current_e = e;
-  while (current_e) {
-    /* Iterate over all items in environment */
-    for (int i = 0; i < current_e->count; i++) {
-      /* Check if the stored string matches the symbol string */
-      /* If it does, return a copy of the value */
-      if (strcmp(current_e->syms[i], k->sym) == 0) {
-        return lval_copy(current_e->vals[i]);
+  cnode *n = cnode_new(c, cnode_call, v->count);
+  lval *op = v->cell[0];
+  if (lval_type(op) == LVAL_SYM && v->count == 3 &&
+      lval_type(v->cell[1]) != LVAL_SEXPR &&
+      lval_type(v->cell[2]) != LVAL_SEXPR) {
+    for (int i = 0; i < sizeof(cnode_ops) / sizeof(cnode_ops[0]); i++) {
+      if (strcmp(op->sym, cnode_ops[i].sym) == 0) {
+        n->run = cnode_ops[i].run;
+        n->builtin = cnode_ops[i].builtin;
       }
     }
-    current_e = current_e->par;
   }
-  /* If no symbol found return error */
-  return lval_err("Unbound Symbol %s", k->sym);
-}
-
-void lenv_put(lenv *e, lval *k, lval *v) {
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
+  if (lval_type(op) == LVAL_SYM && v->count == 4 &&
+      strcmp(op->sym, "if") == 0 && lval_type(v->cell[2]) == LVAL_QEXPR &&
+      lval_type(v->cell[3]) == LVAL_QEXPR) {
+    cnode_free(n);
+    n = cnode_new(c, cnode_if, 6);
+    n->builtin = builtin_if;
+    n->kids[4] = cnode_compile_list(c, v->cell[2], depth + 1);
+    n->kids[5] = cnode_compile_list(c, v->cell[3], depth + 1);
+    if (n->kids[4] == NULL || n->kids[5] == NULL) {
+      cnode_free(n);
+      return NULL;
     }
   }
-
-  e->count++;
-  e->syms = realloc(e->syms, sizeof(char *) * e->count);
-  e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count - 1], k->sym);
-  e->vals[e->count - 1] = lval_copy(v);
-}
-
-void lenv_def(lenv *e, lval *k, lval *v) {
-  /* Iterate till e has no parent */
-  while (e->par) {
-    e = e->par;
+  n->count = v->count;
+  for (int i = 0; i < v->count; i++) {
+    n->kids[i] = cnode_compile(c, v->cell[i], depth + 1);
+    if (n->kids[i] == NULL) {
+      cnode_free(n);
+      return NULL;
+    }
   }
-  /* Put value in e */
-  lenv_put(e, k, v);
+  return n;
 }
 
-lval *lval_eval(lenv *e, lval *v);
-
-lval *builtin_eval(lenv *e, lval *a) {
-  LASSERT(a, (a->count == 1), "Function 'eval' passed too many arguments!")
-  LASSERT(a, (a->cell[0]->type == LVAL_QEXPR),
-          "Function 'eval' passed incorrect type!")
-
-  lval *qexpr = lval_pop(a, 0);
-  lval *result = lval_sexpr();
-  while (qexpr->count > 0) {
-    lval_add(result, lval_pop(qexpr, 0));
-  }
-  lval_del(a);
-  lval_del(qexpr);
-  return lval_eval(e, result);
+/* Run the closures of c in the frame e, see `vm_run` */
+lval *cnode_run(lcode *c, lenv *e, lval **f) {
+  int roots = gc_roots_save();
+  gc_push_env(e);
+  *f = NULL;
+  lval *v = c->tree->run(c->tree, e, f);
+  gc_roots_restore(roots);
+  return v;
 }
 
-void lenv_add_single_builtin(lenv *e, lval *k, lval *v) {
-  lenv_put(e, k, v);
-  lval_del(k);
-  lval_del(v);
+/* Builtins returning a Q-Expression which the caller evaluates as an
+ * S-Expression, so that the calls it makes are in tail position. The
+ * Q-Expression is not modified, so a branch of an `if` in a lambda body is
+ * evaluated without being copied. */
+int lval_tail_builtin(lval *f) {
+  return f->builtin == builtin_eval || f->builtin == builtin_if;
 }
 
-void lenv_add_builtins(lenv *e) {
-  /* Qexpr builtins */
-  lenv_add_single_builtin(e, lval_sym("list"), lval_builtin(builtin_list));
-  lenv_add_single_builtin(e, lval_sym("head"), lval_builtin(builtin_head));
-  lenv_add_single_builtin(e, lval_sym("tail"), lval_builtin(builtin_tail));
-  lenv_add_single_builtin(e, lval_sym("join"), lval_builtin(builtin_join));
-  lenv_add_single_builtin(e, lval_sym("eval"), lval_builtin(builtin_eval));
-  /* Math builtins */
-  lenv_add_single_builtin(e, lval_sym("+"), lval_builtin(builtin_plus));
-  lenv_add_single_builtin(e, lval_sym("-"), lval_builtin(builtin_minus));
-  lenv_add_single_builtin(e, lval_sym("*"), lval_builtin(builtin_times));
-  lenv_add_single_builtin(e, lval_sym("/"), lval_builtin(builtin_div));
-
-  /* Other */
-  lenv_add_single_builtin(e, lval_sym("def"), lval_builtin(builtin_def));
-  lenv_add_single_builtin(e, lval_sym("="), lval_builtin(builtin_put));
-  lenv_add_single_builtin(e, lval_sym("\\"), lval_builtin(builtin_lambda));
+lval *lval_eval_args(lenv *e, lval *v, lval **f);
+
+/* f applied to the arguments v, fewer than its formals: a lambda sharing
+ * the formals and body of f, whose environment only holds the arguments
+ * bound so far. Its formals are the remaining ones, a view of those of f. */
+lval *lval_partial(lval *f, lval *v) {
+  int bound = f->env ? f->env->count : 0;
+  lval *x = lval_alloc();
+  x->type = LVAL_FUN;
+  x->builtin = NULL;
+  x->env = lenv_frame(NULL, bound + v->count);
+  for (int i = 0; i < bound; i++) {
+    lenv_bind(x->env, f->env->syms[i], f->env->vals[i]);
+  }
+  for (int i = 0; i < v->count; i++) {
+    lenv_bind(x->env, f->formals->cell[i]->sym, v->cell[i]);
+  }
+  x->formals = lval_copy(f->formals);
+  x->formals->cell += v->count;
+  x->formals->count -= v->count;
+  x->body = lval_ref(f->body);
+  lval_del(v);
+  gc_write_barrier_all(x);
+  return x;
 }
 
-// TODO implement currying
+/* Calls in tail position, that is the last call of a lambda body or of an
+ * expression given to `eval` or `if`, replace the current call instead of
+ * nesting in it: recursive loops run in constant C stack and memory. */
 lval *lval_call(lenv *e, lval *f, lval *v) {
+  if (f->builtin == builtin_memoized) {
+    return lval_memo_call(e, f, v);
+  }
   // apply builtin
-  if (f->builtin) {
+  if (f->builtin && !lval_tail_builtin(f)) {
     return f->builtin(e, v);
   }
-  // apply lambda
   lval *result;
-  // bind formals to arguments
-  lenv *lambda_e = lenv_new();
-  lambda_e->par = e;
-  for (int i = 0; i < f->formals->count; i++) {
-    lenv_put(lambda_e, f->formals->cell[i], v->cell[i]);
+  /* Frame of the lambda currently running, if any */
+  lenv *frame = NULL;
+  f = lval_ref(f);
+  int roots = gc_roots_save();
+  while (1) {
+    gc_roots_restore(roots);
+    gc_push_env(e);
+    gc_push_val(&f);
+    lval *g;
+    if (f->builtin == builtin_memoized) {
+      result = lval_memo_call(e, f, v);
+      break;
+    }
+    if (f->builtin && !lval_tail_builtin(f)) {
+      result = f->builtin(e, v);
+      break;
+    }
+    if (f->builtin) {
+      lval *x = f->builtin(e, v);
+      if (lval_type(x) != LVAL_QEXPR) {
+        result = x;
+        break;
+      }
+      v = lval_eval_args(e, x, &g);
+    } else {
+      // apply lambda
+      if (v->count > f->formals->count) {
+        result = lval_err("Function passed too many arguments. "
+                          "Got %i, Expected %i.",
+                          v->count, f->formals->count);
+        lval_del(v);
+        break;
+      }
+      if (v->count < f->formals->count) {
+        result = lval_partial(f, v);
+        break;
+      }
+      // bind formals to arguments, after those bound by a partial application
+      int bound = f->env ? f->env->count : 0;
+      lenv *lambda_e = lenv_frame(e, bound + f->formals->count);
+      for (int i = 0; i < bound; i++) {
+        lenv_bind(lambda_e, f->env->syms[i], f->env->vals[i]);
+      }
+      for (int i = 0; i < f->formals->count; i++) {
+        lenv_put(lambda_e, f->formals->cell[i], v->cell[i]);
+      }
+      lval_del(v);
+      /* A tail call: the frame it replaces can only be seen through
+       * lambda_e now, so fold it into it */
+      if (frame) {
+        lenv_frame_merge(lambda_e, frame);
+        lenv_frame_del(frame);
+      }
+      e = frame = lambda_e;
+      /* The replaced frame may be gone, drop it from the roots */
+      gc_roots_restore(roots);
+      gc_push_env(e);
+      gc_push_val(&f);
+      // evaluate body
+      lcode *code = lval_code(f);
+      if (code) {
+        vm_calls++;
+        v = code->tree ? cnode_run(code, e, &g) : vm_run(code, e, &g);
+      } else {
+        tree_calls++;
+        v = lval_eval_args(e, lval_ref(f->body), &g);
+      }
+    }
+    lval_del(f);
+    f = g;
+    if (f == NULL) {
+      result = v;
+      break;
+    }
+  }
+  gc_roots_restore(roots);
+  if (f) {
+    lval_del(f);
+  }
+  if (frame) {
+    lenv_frame_del(frame);
   }
-  lval_del(v);
-  // evaluate body
-  result = builtin_eval(lambda_e, lval_add(lval_sexpr(), lval_copy(f->body)));
-  lenv_del(lambda_e);
   return result;
 }
 
-lval *lval_eval_sexpr(lenv *e, lval *v) {
-  /* Evaluate children */
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
-  }
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) {
-      return lval_take(v, i);
+/* Expressions being evaluated by `lval_eval_args`, for all the calls in
+ * progress */
+walk eval_stack = {0};
+
+/* Evaluate the children of v. Returns the value of v if it is not a call,
+ * otherwise sets *f to the function and returns its arguments. v may also
+ * be a Q-Expression, evaluated as if it were an S-Expression.
+ *
+ * Children which are S-Expressions are not evaluated by recursing: each
+ * expression being evaluated is on the VM stack, followed by the values of
+ * its children so far, which keeps them out of the way of the collector
+ * too. Only calls to lambdas nest in the C stack. */
+lval *lval_eval_args(lenv *e, lval *v, lval **f) {
+  int roots = gc_roots_save();
+  gc_push_env(e);
+  int base = eval_stack.count;
+  /* arg is where the expression of a frame is on the VM stack */
+  walk_push(&eval_stack, NULL)->arg = vm_sp;
+  vm_push(v);
+  gc_maybe_collect();
+
+  lval *result;
+  while (1) {
+    walk_frame *t = walk_top(&eval_stack);
+    lval *x = vm_stack[t->arg];
+    if (t->i < x->count) {
+      lval *y = x->cell[t->i++];
+      if (lval_type(y) == LVAL_SEXPR) {
+        walk_push(&eval_stack, NULL)->arg = vm_sp;
+        vm_push(lval_ref(y));
+        gc_maybe_collect();
+      } else {
+        vm_push(lval_eval(e, lval_ref(y)));
+      }
+      continue;
     }
-  }
 
-  if (v->count == 0) {
-    return v;
+    /* Every child of x has been evaluated */
+    int n = vm_sp - t->arg - 1;
+    lval *g = NULL;
+    if (n == 0) {
+      result = lval_sexpr();
+    } else if (n == 1) {
+      result = vm_stack[--vm_sp];
+    } else {
+      result = vm_pop_call(n, &g);
+    }
+    lval_del(vm_stack[--vm_sp]);
+    eval_stack.count--;
+    if (eval_stack.count == base) {
+      *f = g;
+      break;
+    }
+    if (g) {
+      /* The function stays on the stack until the call returns */
+      vm_push(g);
+      result = lval_call(e, g, result);
+      lval_del(vm_stack[--vm_sp]);
+    }
+    vm_push(result);
   }
+  gc_roots_restore(roots);
+  return result;
+}
 
-  if (v->count == 1) {
-    return lval_take(v, 0);
-  }
-  /* at this point, we have a valid expression with more than one expression */
-  lval *f = lval_pop(v, 0);
-  /* Check that it starts with an expression, and if not return an error */
-  if (f->type != LVAL_FUN) {
-    lval_del(f);
-    lval_del(v);
-    return lval_err("first element is not a function");
+lval *lval_eval_sexpr(lenv *e, lval *v) {
+  lval *f;
+  v = lval_eval_args(e, v, &f);
+  if (f == NULL) {
+    return v;
   }
+  /* f must outlive the call, while v is consumed by it */
+  int roots = gc_roots_save();
+  gc_push_env(e);
+  gc_push_val(&f);
   lval *result = lval_call(e, f, v);
+  gc_roots_restore(roots);
   lval_del(f);
   return result;
 }
 
 lval *lval_eval(lenv *e, lval *v) {
   /* Evaluate Sexpressions */
-  if (v->type == LVAL_SYM) {
+  if (lval_type(v) == LVAL_SYM) {
     lval *x = lenv_get(e, v);
     lval_del(v);
     return x;
   }
-  if (v->type == LVAL_SEXPR) {
+  if (lval_type(v) == LVAL_SEXPR) {
     return lval_eval_sexpr(e, v);
   }
   return v;
 }
 
 lenv *lenv_new(void) {
-  lenv *e = malloc(sizeof(lenv));
+  lenv *e = pool_alloc(sizeof(lenv));
+  e->type = OBJ_ENV;
+  e->mark = 0;
+  e->rc = 1;
   e->par = NULL;
   e->count = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->capacity = 0;
+  e->index_capacity = 0;
+  e->index = NULL;
+  return e;
+}
+
+/* Frame for a call binding `count` formals, child of par. Small frames are
+ * recycled together with their syms and vals, so that a call does not
+ * allocate anything once the pool is warm. */
+lenv *lenv_frame(lenv *par, int count) {
+  int c = 0;
+  while ((1 << c) < count) {
+    c++;
+  }
+  lenv *e;
+  if (c >= FRAME_CLASSES) {
+    e = lenv_new();
+  } else if (frame_pool[c]) {
+    e = frame_pool[c];
+    frame_pool[c] = e->par;
+  } else {
+    e = lenv_new();
+    e->capacity = 1 << c;
+    e->syms = malloc(sizeof(char *) * e->capacity);
+    e->vals = malloc(sizeof(lval *) * e->capacity);
+  }
+  e->par = par;
   return e;
 }
 
+/* Give a frame from `lenv_frame` back */
+void lenv_frame_del(lenv *e) {
+  int c = 0;
+  while ((1 << c) < e->capacity) {
+    c++;
+  }
+  /* Frames which grew an index, or too much, are not worth keeping */
+  if (e->rc > 1 || e->index || c >= FRAME_CLASSES) {
+    lenv_del(e);
+    return;
+  }
+  for (int i = 0; i < e->count; i++) {
+    lval_del(e->vals[i]);
+  }
+  e->count = 0;
+  e->par = frame_pool[c];
+  frame_pool[c] = e;
+}
+
 void lenv_del(lenv *e) {
+  if (e == NULL || --e->rc > 0) {
+    return;
+  }
   for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
     lval_del(e->vals[i]);
   }
   free(e->syms);
   free(e->vals);
-  free(e);
+  free(e->index);
+  pool_free(e, sizeof(lenv));
 }
 
 int main(int argc, char **argv) {
   /* Create Some Parsers */
   mpc_parser_t *Number = mpc_new("number");
   mpc_parser_t *Symbol = mpc_new("symbol");
-  mpc_parser_t *SExpr = mpc_new("sexpr");
-  mpc_parser_t *QExpr = mpc_new("qexpr");
+  mpc_parser_t *Bracket = mpc_new("bracket");
   mpc_parser_t *Expr = mpc_new("expr");
   mpc_parser_t *Lispy = mpc_new("lispy");
 
-  /* Define them with the following Language */
+  /* Define them with the following Language. Brackets are matched by
+   * `lval_read`, the parser would recurse into nested lists. */
   mpca_lang(MPCA_LANG_DEFAULT,
             "                                                     \
       number   : /-?[0-9]+/ ;                             \
       symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
-      sexpr    : '(' <expr>* ')' ;  \
-      qexpr  : '{' <expr>* '}' ;                         \
-      expr     : <number> | <symbol> | <sexpr> | <qexpr> ;  \
+      bracket  : '(' | ')' | '{' | '}' ;  \
+      expr     : <number> | <symbol> | <bracket> ;  \
       lispy    : /^/ <expr>* /$/ ;             \
     ",
-            Number, Symbol, SExpr, QExpr, Expr, Lispy);
+            Number, Symbol, Bracket, Expr, Lispy);
 
   /* Print Version and Exit Information */
   puts("Lispy Version 0.0.0.0.2");
   puts("Press Ctrl+c to Exit\n");
 
-  /* Create environment */
+  /* Create environment, which is the root of everything the collector keeps */
+  gc_init();
   lenv *e = lenv_new();
+  e->mark |= GC_TENURED;
+  lenv_global = e;
   lenv_add_builtins(e);
+  gc_push_env(e);
 
   /* In a never ending loop */
   while (1) {
@@ -779,10 +3676,17 @@ int main(int argc, char **argv) {
 
     /* Comments TODO handle this properly in grammar */
     if (strlen(input) > 0 && strstr(input, "#")) {
+      free(input);
       continue;
     }
     if (strcmp(input, "printenv") == 0) {
       lenv_println(e);
+      free(input);
+      continue;
+    }
+    if (strcmp(input, "printstats") == 0) {
+      stats_println();
+      free(input);
       continue;
     }
 
@@ -794,6 +3698,8 @@ int main(int argc, char **argv) {
       lval_println(v);
       lval_del(v);
       mpc_ast_delete(result.output);
+      gc_end_form();
+      gc_maybe_collect();
     } else {
       /* Otherwise Print the Error */
       mpc_err_print(result.error);
@@ -804,7 +3710,7 @@ int main(int argc, char **argv) {
     free(input);
   }
   /* Undefine and Delete our Parsers */
-  mpc_cleanup(6, Number, Symbol, SExpr, QExpr, Expr, Lispy);
+  mpc_cleanup(5, Number, Symbol, Bracket, Expr, Lispy);
   /* Delete environment */
   lenv_del(e);
   return 0;
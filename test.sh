@@ -1,5 +1,5 @@
 #!/bin/bash
-cc -std=c99 -Wall -g lispy.c mpc.c -ledit -lm -o lispy && ./lispy < test_input.txt > tmp.txt
+cc -std=c11 -Wall -g lispy.c mpc.c -ledit -lm -o lispy && ./lispy < test_input.txt > tmp.txt
 
 # TODO: try to remove the first 3 lines of the comparison, with `tail -n +4 <file>
 diff tmp.txt test_expected.txt
@@ -8,8 +8,30 @@ then
   echo "test failed"
   rm tmp.txt
   exit 1
-else
-  echo "test successful"
-  rm tmp.txt
-  exit 0
 fi
+rm tmp.txt
+
+# Deeply nested expressions must not depend on the size of the C stack.
+# With a nursery larger than them, they are still young when `def` or a
+# memoized function copy them out of it.
+cc -std=c11 -Wall -g -DNURSERY_SIZE=200000 lispy.c mpc.c -ledit -lm \
+  -o lispy-nursery || exit 1
+depth=100000
+sexpr="$(printf '(+ 1 %.0s' $(seq $depth))0$(printf ')%.0s' $(seq $depth))"
+qexpr="$(printf '{%.0s' $(seq $depth))$(printf '}%.0s' $(seq $depth))"
+expected=$(printf '%s\n' "$depth" "()" "1" "$qexpr" "()" "1" "()")
+for lispy in ./lispy ./lispy-nursery
+do
+  result=$(ulimit -s 1024 && printf '%s\n' "$sexpr" "def {deep} $qexpr" \
+    "== deep (eval (list deep))" "deep" "def {id} (memo (\\ {x} {x}))" \
+    "== (id $qexpr) deep" "def {deep} 0" "q" | $lispy | tail -n +4)
+  if [ "$result" != "$expected" ]
+  then
+    echo "deep nesting test failed with $lispy"
+    rm lispy-nursery
+    exit 1
+  fi
+done
+rm lispy-nursery
+echo "test successful"
+exit 0